@@ -0,0 +1,330 @@
+#ifndef DOMAIN_DECOMPOSITION_H
+#define DOMAIN_DECOMPOSITION_H
+
+#include <glm/glm.hpp>
+
+#include <iostream>
+#include <limits>
+#include <utility>
+#include <vector>
+
+#include "Simulator.h"
+#include "Transport.h"
+
+// the subdomain of a rank, when the container is split into numSubdomains boxes along the axes:
+// owned particles which leave the box migrate to adjacent subdomains, and owned particles
+// within neighbourDistance of an adjacent box are sent there as ghost particles
+class Subdomain : public HaloExchange {
+private:
+    Transport &transport;
+    glm::ivec3 numSubdomains;
+    glm::ivec3 coordinates; // position of the subdomain in the grid of subdomains
+
+    glm::vec3 domainMin; // interior of the container
+    glm::vec3 subdomainSize;
+    float haloWidth = 0.0f;
+
+    std::vector<int> neighbourRanks; // ranks of adjacent subdomains (including diagonal ones)
+    int neighbourSlots[27]; // index in neighbourRanks of the subdomain at each offset (-1 if none)
+    std::vector<std::vector<int>> sendIndices; // owned particles sent as ghost particles to each neighbour
+    std::vector<std::pair<int, int>> receiveRanges; // ghost particles received from each neighbour
+    bool connected = true; // false once a message of a neighbour could not be received
+
+    int getRank(const glm::ivec3 &subdomainCoordinates) const {
+        return (subdomainCoordinates.x * numSubdomains.y + subdomainCoordinates.y) * numSubdomains.z + subdomainCoordinates.z;
+    }
+
+    void getBox(const glm::ivec3 &subdomainCoordinates, glm::vec3 &boxMin, glm::vec3 &boxMax) const {
+        boxMin = domainMin + glm::vec3(subdomainCoordinates) * subdomainSize;
+        boxMax = domainMin + glm::vec3(subdomainCoordinates + 1) * subdomainSize;
+
+        // outer subdomains extend to infinity, so every particle has an owner
+        for (int axis = 0; axis < 3; ++axis) {
+            if (subdomainCoordinates[axis] == 0)
+                boxMin[axis] = -std::numeric_limits<float>::max();
+            if (subdomainCoordinates[axis] == numSubdomains[axis] - 1)
+                boxMax[axis] = std::numeric_limits<float>::max();
+        }
+    }
+
+    bool isInBox(const glm::vec3 &position, const glm::vec3 &boxMin, const glm::vec3 &boxMax, float margin) const {
+        return glm::all(glm::greaterThanEqual(position, boxMin - margin)) && glm::all(glm::lessThan(position, boxMax + margin));
+    }
+
+    // neighbour which owns the position, or the one in its direction if it moved further (-1 if owned)
+    int findOwner(const Simulator &simulator, const glm::vec3 &position) const {
+        if (simulator.isInSubdomain(position))
+            return -1;
+
+        glm::ivec3 offset(0);
+        for (int axis = 0; axis < 3; ++axis)
+            if (position[axis] < simulator.subdomainMin[axis])
+                offset[axis] = -1;
+            else if (position[axis] >= simulator.subdomainMax[axis])
+                offset[axis] = 1;
+
+        return neighbourSlots[(offset.x + 1) * 9 + (offset.y + 1) * 3 + offset.z + 1];
+    }
+
+    void sendToNeighbours(std::vector<Message> &messages) {
+        for (int n = 0; n < static_cast<int>(neighbourRanks.size()); ++n)
+            transport.send(neighbourRanks[n], std::move(messages[n]));
+    }
+
+    bool receiveFromNeighbour(int n, Message &message) {
+        if (transport.receive(neighbourRanks[n], message))
+            return true;
+
+        std::cout << "ERROR: Lost the connection to rank " << neighbourRanks[n] << std::endl;
+        connected = false;
+        message.clear();
+        return false;
+    }
+
+    template <typename T>
+    void sendGhostValues(const Simulator::particle_vector<T> &array, std::vector<Message> &messages) const {
+        for (int n = 0; n < static_cast<int>(neighbourRanks.size()); ++n)
+            for (int i : sendIndices[n])
+                writeMessage(messages[n], &array[i], 1);
+    }
+
+    template <typename T>
+    void receiveGhostValues(Simulator::particle_vector<T> &array, int n, const Message &message, std::size_t &offset) const {
+        int begin = receiveRanges[n].first;
+        readMessage(message, offset, array.data() + begin, receiveRanges[n].second - begin);
+    }
+
+public:
+    Subdomain(Transport &transport, const glm::ivec3 &numSubdomains) : transport(transport), numSubdomains(numSubdomains) {
+        int rank = transport.getRank();
+        coordinates = glm::ivec3(rank / (numSubdomains.y * numSubdomains.z), rank / numSubdomains.z % numSubdomains.y, rank % numSubdomains.z);
+
+        for (int slot = 0; slot < 27; ++slot) {
+            glm::ivec3 neighbourCoordinates = coordinates + glm::ivec3(slot / 9, slot / 3 % 3, slot % 3) - 1;
+            neighbourSlots[slot] = -1;
+            if (neighbourCoordinates != coordinates && glm::all(glm::greaterThanEqual(neighbourCoordinates, glm::ivec3(0))) &&
+                glm::all(glm::lessThan(neighbourCoordinates, numSubdomains))) {
+                neighbourSlots[slot] = static_cast<int>(neighbourRanks.size());
+                neighbourRanks.push_back(getRank(neighbourCoordinates));
+            }
+        }
+
+        sendIndices.resize(neighbourRanks.size());
+        receiveRanges.resize(neighbourRanks.size());
+    }
+
+    // restricts the simulator to the subdomain and recreates its particles
+    void attach(Simulator &simulator) {
+        // all ranks take the same number of substeps and iterations, and every owned particle is updated in every timestep
+        simulator.solverType = SolverType::PBF;
+        simulator.iterationMethod = IterationMethod::JACOBI;
+        simulator.adaptiveIteration = false;
+        simulator.adaptiveTimeStep = false;
+        simulator.chebyshevAcceleration = false;
+        simulator.warmStartLambdas = false;
+        simulator.multilevelSolve = false;
+        simulator.particleSleeping = false;
+        simulator.multiRate = false;
+
+        // the container of the last reset is split
+        domainMin = simulator.positionMin;
+        subdomainSize = (simulator.positionMax - simulator.positionMin) / glm::vec3(numSubdomains);
+        haloWidth = simulator.neighbourDistance;
+
+        getBox(coordinates, simulator.subdomainMin, simulator.subdomainMax);
+        simulator.haloExchange = this;
+        simulator.reset();
+    }
+
+    void migrate(Simulator &simulator) override {
+        if (!connected)
+            return;
+
+        int numNeighbours = static_cast<int>(neighbourRanks.size());
+        int numOwned = simulator.getNumOwnedParticles();
+
+        // owned particles which left the subdomain are sent with their states, the others are compacted
+        std::vector<Message> messages(numNeighbours);
+        int numKept = 0;
+        for (int i = 0; i < numOwned; ++i) {
+            int n = findOwner(simulator, simulator.positions[i]);
+            if (n < 0) {
+                simulator.positions[numKept] = simulator.positions[i];
+                simulator.lastPositions[numKept] = simulator.lastPositions[i];
+                simulator.velocities[numKept] = simulator.velocities[i];
+                ++numKept;
+            } else {
+                writeMessage(messages[n], &simulator.positions[i], 1);
+                writeMessage(messages[n], &simulator.lastPositions[i], 1);
+                writeMessage(messages[n], &simulator.velocities[i], 1);
+            }
+        }
+
+        sendToNeighbours(messages);
+
+        std::vector<Message> received(numNeighbours);
+        int numArrived = 0;
+        for (int n = 0; n < numNeighbours; ++n)
+            if (receiveFromNeighbour(n, received[n]))
+                numArrived += received[n].size() / (3 * sizeof(glm::vec3));
+
+        numOwned = numKept + numArrived;
+        simulator.resizeFluidParticles(numKept, numOwned, 0);
+        if (!connected) // the particles sent to the lost neighbour are gone
+            return;
+
+        int arrival = numKept;
+        for (int n = 0; n < numNeighbours; ++n) {
+            std::size_t offset = 0;
+            while (arrival < numOwned && readMessage(received[n], offset, &simulator.positions[arrival], 1)) {
+                readMessage(received[n], offset, &simulator.lastPositions[arrival], 1);
+                readMessage(received[n], offset, &simulator.velocities[arrival], 1);
+                ++arrival;
+            }
+        }
+
+        // owned particles near the faces of the subdomain are ghost particles of the adjacent subdomains
+        messages.assign(numNeighbours, Message());
+        for (std::vector<int> &indices : sendIndices)
+            indices.clear();
+
+        std::vector<glm::vec3> neighbourMins(numNeighbours), neighbourMaxs(numNeighbours);
+        for (int slot = 0; slot < 27; ++slot)
+            if (neighbourSlots[slot] >= 0)
+                getBox(coordinates + glm::ivec3(slot / 9, slot / 3 % 3, slot % 3) - 1, neighbourMins[neighbourSlots[slot]], neighbourMaxs[neighbourSlots[slot]]);
+
+        for (int i = 0; i < numOwned; ++i) {
+            const glm::vec3 &position = simulator.positions[i];
+            if (simulator.isInSubdomain(position, -haloWidth)) // interior particles
+                continue;
+
+            for (int n = 0; n < numNeighbours; ++n)
+                if (isInBox(position, neighbourMins[n], neighbourMaxs[n], haloWidth))
+                    sendIndices[n].push_back(i);
+        }
+
+        sendGhostValues(simulator.positions, messages);
+        sendGhostValues(simulator.velocities, messages);
+        sendToNeighbours(messages);
+
+        int numGhost = 0;
+        for (int n = 0; n < numNeighbours; ++n) {
+            if (!receiveFromNeighbour(n, received[n]))
+                return; // without ghost particles
+
+            int numReceived = received[n].size() / (2 * sizeof(glm::vec3));
+            receiveRanges[n] = std::make_pair(numOwned + numGhost, numOwned + numGhost + numReceived);
+            numGhost += numReceived;
+        }
+
+        simulator.resizeFluidParticles(numOwned, numOwned, numGhost);
+
+        for (int n = 0; n < numNeighbours; ++n) {
+            std::size_t offset = 0;
+            receiveGhostValues(simulator.positions, n, received[n], offset);
+            receiveGhostValues(simulator.velocities, n, received[n], offset);
+        }
+    }
+
+    void exchange(Simulator &simulator, HaloField field) override {
+        if (!connected)
+            return;
+
+        int numNeighbours = static_cast<int>(neighbourRanks.size());
+
+        std::vector<Message> messages(numNeighbours);
+        switch (field) {
+            case (HaloField::POSITIONS):
+                sendGhostValues(simulator.positions, messages);
+                break;
+            case (HaloField::DENSITIES_AND_LAMBDAS):
+                sendGhostValues(simulator.densities, messages);
+                sendGhostValues(simulator.lambdas, messages);
+                break;
+            case (HaloField::VELOCITIES):
+                sendGhostValues(simulator.velocities, messages);
+                break;
+            default:
+                sendGhostValues(simulator.vorticityDeltaVelocities, messages);
+        }
+
+        sendToNeighbours(messages);
+
+        for (int n = 0; n < numNeighbours; ++n) {
+            Message message;
+            if (!receiveFromNeighbour(n, message))
+                return;
+
+            std::size_t offset = 0;
+            switch (field) {
+                case (HaloField::POSITIONS):
+                    receiveGhostValues(simulator.positions, n, message, offset);
+                    break;
+                case (HaloField::DENSITIES_AND_LAMBDAS):
+                    receiveGhostValues(simulator.densities, n, message, offset);
+                    receiveGhostValues(simulator.lambdas, n, message, offset);
+                    break;
+                case (HaloField::VELOCITIES):
+                    receiveGhostValues(simulator.velocities, n, message, offset);
+                    break;
+                default:
+                    receiveGhostValues(simulator.vorticityDeltaVelocities, n, message, offset);
+            }
+        }
+    }
+
+    bool isConnected() const override {
+        return connected;
+    }
+
+    // sum of values of all ranks, added in the order of ranks so every rank gets the same result
+    double sumOverRanks(double value) {
+        int rank = transport.getRank();
+        int numRanks = transport.getNumRanks();
+
+        for (int r = 0; r < numRanks; ++r)
+            if (r != rank) {
+                Message message;
+                writeMessage(message, &value, 1);
+                transport.send(r, std::move(message));
+            }
+
+        double sum = 0.0;
+        for (int r = 0; r < numRanks; ++r) {
+            double rankValue = value;
+            Message message;
+            std::size_t offset = 0;
+            if (r != rank && transport.receive(r, message))
+                readMessage(message, offset, &rankValue, 1);
+
+            sum += rankValue;
+        }
+
+        return sum;
+    }
+
+    double maxOverRanks(double value) {
+        int rank = transport.getRank();
+        int numRanks = transport.getNumRanks();
+
+        for (int r = 0; r < numRanks; ++r)
+            if (r != rank) {
+                Message message;
+                writeMessage(message, &value, 1);
+                transport.send(r, std::move(message));
+            }
+
+        double max = value;
+        for (int r = 0; r < numRanks; ++r) {
+            Message message;
+            std::size_t offset = 0;
+            double rankValue = value;
+            if (r != rank && transport.receive(r, message) && readMessage(message, offset, &rankValue, 1))
+                max = glm::max(max, rankValue);
+        }
+
+        return max;
+    }
+};
+
+#endif
@@ -0,0 +1,105 @@
+#ifndef ENSEMBLE_H
+#define ENSEMBLE_H
+
+#include <omp.h>
+
+#include <glm/glm.hpp>
+
+#include <fstream>
+#include <ios>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "Simulator.h"
+
+struct EnsembleRun {
+    std::string name; // prefix of the output files of the run
+    std::unique_ptr<Simulator> simulator;
+    double wallClockTime = 0.0; // wall-clock time of all frames of the run
+};
+
+// runs independent simulators with their own parameters concurrently, for parameter studies of small scenes
+class Ensemble {
+public:
+    int numFrames = 100; // frames simulated by each run
+    int outputInterval = 10; // frames between rows of statistics
+    bool writePositions = false; // write positions of fluid particles with each row of statistics
+    std::string outputDirectory = ".";
+
+    // runs share the threads: threadsPerRun threads simulate each run (nested parallelism if greater than 1),
+    // so numThreads / threadsPerRun runs are simulated at once
+    int threadsPerRun = 1;
+
+    std::vector<EnsembleRun> runs;
+
+    Simulator &add(const std::string &name, std::unique_ptr<Simulator> simulator) {
+        runs.emplace_back();
+        runs.back().name = name;
+        runs.back().simulator = std::move(simulator);
+        return *runs.back().simulator;
+    }
+
+    void run() {
+        int numRunThreads = glm::max(threadsPerRun, 1);
+        int numConcurrentRuns = glm::max(omp_get_max_threads() / numRunThreads, 1);
+
+        int nested = omp_get_nested();
+        omp_set_nested(numRunThreads > 1);
+
+        // runs of different sizes are balanced by handing them out one by one
+        #pragma omp parallel for schedule(dynamic, 1) num_threads(numConcurrentRuns)
+        for (int i = 0; i < static_cast<int>(runs.size()); ++i) {
+            runs[i].simulator->numThreads = numRunThreads;
+            simulate(runs[i]);
+        }
+
+        omp_set_nested(nested);
+
+        writeSummary();
+    }
+
+    void simulate(EnsembleRun &run) {
+        Simulator &simulator = *run.simulator;
+
+        std::ofstream statistics(outputDirectory + "/" + run.name + ".csv");
+        statistics << "frame,simulated time,wall-clock time,substeps,iterations,average density error,max density error,state hash" << std::endl;
+
+        std::ofstream positions;
+        if (writePositions)
+            positions.open(outputDirectory + "/" + run.name + "_positions.txt");
+
+        double startTime = omp_get_wtime();
+        simulator.isPaused = false;
+
+        for (int frame = 1; frame <= numFrames; ++frame) {
+            simulator.simulate();
+
+            if (frame % outputInterval != 0 && frame != numFrames)
+                continue;
+
+            statistics << frame << "," << simulator.simulatedTime << "," << simulator.wallClockTime << "," << simulator.numSubsteps
+                << "," << simulator.numIterationUsed << "," << simulator.averageDensityError << "," << simulator.maxDensityError
+                << "," << std::hex << simulator.hashState() << std::dec << std::endl;
+
+            if (writePositions) {
+                positions << "frame " << frame << "\n";
+                for (int i = 0; i < simulator.numFluidParticles; ++i)
+                    positions << simulator.positions[i].x << " " << simulator.positions[i].y << " " << simulator.positions[i].z << "\n";
+            }
+        }
+
+        run.wallClockTime = omp_get_wtime() - startTime;
+    }
+
+    void writeSummary() const {
+        std::ofstream summary(outputDirectory + "/summary.csv");
+        summary << "run,fluid particles,simulated time,wall-clock time" << std::endl;
+        for (const EnsembleRun &run : runs)
+            summary << run.name << "," << run.simulator->numFluidParticles << "," << run.simulator->simulatedTime
+                << "," << run.wallClockTime << std::endl;
+    }
+};
+
+#endif
@@ -1,12 +1,10 @@
 #include "Kernel.h"
 
-float Kernel::h; // kernel radius
-float Kernel::h2;
-float Kernel::factorWPoly6;
-float Kernel::factorGradWSpiky;
+float Kernel::WPoly6(const glm::vec3 &r) const {
+    return WPoly6(glm::dot(r, r));
+}
 
-float Kernel::WPoly6(const glm::vec3 &r) {
-    float rNorm2 = glm::dot(r, r);
+float Kernel::WPoly6(float rNorm2) const {
     if (rNorm2 < h2) {
         float diff = h2 - rNorm2;
         return factorWPoly6 * diff * diff * diff;
@@ -14,8 +12,12 @@ float Kernel::WPoly6(const glm::vec3 &r) {
         return 0.0f;
 }
 
-glm::vec3 Kernel::gradWSpiky(const glm::vec3 &r) {
-    float rNorm = glm::length(r);
+glm::vec3 Kernel::gradWSpiky(const glm::vec3 &r) const {
+    return gradWSpiky(r, glm::dot(r, r));
+}
+
+glm::vec3 Kernel::gradWSpiky(const glm::vec3 &r, float rNorm2) const {
+    float rNorm = glm::sqrt(rNorm2);
     if (rNorm > 1.0e-6f && rNorm < h) {
         return factorGradWSpiky * (h - rNorm) * (h - rNorm) / rNorm * r;
     } else
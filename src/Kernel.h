@@ -6,15 +6,17 @@
 
 class Kernel {
 private:
-    static float h; // kernel radius
-    static float h2;
-    static float factorWPoly6;
-    static float factorGradWSpiky;
+    float h = 0.0f; // kernel radius
+    float h2 = 0.0f;
+    float factorWPoly6 = 0.0f;
+    float factorGradWSpiky = 0.0f;
 
 public:
-    static float WPoly6(const glm::vec3 &r);
-    static glm::vec3 gradWSpiky(const glm::vec3 &r);
-    static void setKernelRadius(float kernelRadius);
+    float WPoly6(const glm::vec3 &r) const;
+    float WPoly6(float rNorm2) const;
+    glm::vec3 gradWSpiky(const glm::vec3 &r) const;
+    glm::vec3 gradWSpiky(const glm::vec3 &r, float rNorm2) const;
+    void setKernelRadius(float kernelRadius);
 };
 
 #endif
\ No newline at end of file
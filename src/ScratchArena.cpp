@@ -0,0 +1,89 @@
+#include "ScratchArena.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <utility>
+
+#include "Threading.h"
+
+ScratchArena::ScratchArena() {
+    // blocks double in size, so the list of blocks never grows
+    blocks.reserve(maxNumBlocks);
+}
+
+ScratchArena::ScratchArena(ScratchArena &&other) noexcept : blocks(std::move(other.blocks)), top(other.top) {
+    other.blocks.clear();
+    other.top = Mark();
+}
+
+ScratchArena &ScratchArena::operator=(ScratchArena &&other) noexcept {
+    if (this != &other) {
+        freeBlocks();
+        blocks = std::move(other.blocks);
+        top = other.top;
+        other.blocks.clear();
+        other.top = Mark();
+    }
+
+    return *this;
+}
+
+ScratchArena::~ScratchArena() {
+    freeBlocks();
+}
+
+void *ScratchArena::allocateBytes(std::size_t size, std::size_t alignment, bool take) {
+    while (true) {
+        // blocks after the top are reused after rewinding
+        for (; top.blockIndex < blocks.size(); ++top.blockIndex, top.blockOffset = 0) {
+            const Block &block = blocks[top.blockIndex];
+            std::uintptr_t address = reinterpret_cast<std::uintptr_t>(block.data) + top.blockOffset;
+            std::size_t padding = (alignment - address % alignment) % alignment;
+            if (top.blockOffset + padding + size <= block.size) {
+                top.blockOffset += padding;
+                void *data = block.data + top.blockOffset;
+                if (take)
+                    top.blockOffset += size;
+
+                return data;
+            }
+        }
+
+        addBlock(size + alignment);
+        top.blockIndex = blocks.size() - 1;
+        top.blockOffset = 0;
+    }
+}
+
+void ScratchArena::addBlock(std::size_t minSize) {
+    // blocks double in size, so a growing arena allocates few of them
+    std::size_t size = std::max(minSize, blocks.empty() ? minBlockSize : 2 * blocks.back().size);
+    blocks.push_back({ static_cast<char *>(Threading::allocatePages(size)), size });
+}
+
+void ScratchArena::freeBlocks() {
+    for (const Block &block : blocks)
+        Threading::freePages(block.data, block.size);
+
+    blocks.clear();
+}
+
+void ScratchArena::reset(std::size_t minCapacity) {
+    // one block of twice the size of all blocks holds the same allocations next time, with room for them to grow
+    std::size_t capacity = getCapacity();
+    if (blocks.size() > 1 || capacity < minCapacity) {
+        std::size_t size = std::max(blocks.size() > 1 ? 2 * capacity : capacity, minCapacity);
+        freeBlocks();
+        addBlock(size);
+    }
+
+    top = Mark();
+}
+
+std::size_t ScratchArena::getCapacity() const {
+    std::size_t capacity = 0;
+    for (const Block &block : blocks)
+        capacity += block.size;
+
+    return capacity;
+}
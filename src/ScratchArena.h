@@ -0,0 +1,86 @@
+#ifndef SCRATCH_ARENA_H
+#define SCRATCH_ARENA_H
+
+#include <cstddef>
+#include <vector>
+
+// contiguous values in memory owned by something else, such as a scratch arena or a grid
+template <typename T>
+struct Span {
+    T *data = nullptr;
+    int count = 0;
+
+    Span() = default;
+    Span(T *data, int count) : data(data), count(count) {}
+
+    T *begin() const { return data; }
+    T *end() const { return data + count; }
+    int size() const { return count; }
+    bool empty() const { return count == 0; }
+    T &operator[](int i) const { return data[i]; }
+};
+
+// bump allocator for temporaries which die together: reset() frees all allocations at once and keeps the memory,
+// so repeating the same allocations allocates nothing from the heap (values are neither initialized nor destroyed)
+class ScratchArena {
+public:
+    struct Mark {
+        std::size_t blockIndex = 0;
+        std::size_t blockOffset = 0;
+    };
+
+private:
+    struct Block {
+        char *data;
+        std::size_t size;
+    };
+
+    static const std::size_t minBlockSize = 64 * 1024;
+    static const std::size_t maxNumBlocks = 64;
+
+    std::vector<Block> blocks;
+    Mark top; // position of the next allocation
+
+    void *allocateBytes(std::size_t size, std::size_t alignment, bool take);
+    void addBlock(std::size_t minSize);
+    void freeBlocks();
+
+public:
+    ScratchArena();
+    ScratchArena(const ScratchArena &) = delete;
+    ScratchArena(ScratchArena &&other) noexcept;
+    ScratchArena &operator=(const ScratchArena &) = delete;
+    ScratchArena &operator=(ScratchArena &&other) noexcept;
+    ~ScratchArena();
+
+    template <typename T>
+    T *allocate(std::size_t count) {
+        return static_cast<T *>(allocateBytes(count * sizeof(T), alignof(T), true));
+    }
+
+    // space for up to count values at the top, of which commit() allocates the first ones (for lists of unknown length)
+    template <typename T>
+    T *reserve(std::size_t count) {
+        return static_cast<T *>(allocateBytes(count * sizeof(T), alignof(T), false));
+    }
+
+    template <typename T>
+    void commit(std::size_t count) {
+        top.blockOffset += count * sizeof(T);
+    }
+
+    // allocations after a mark are freed by rewinding to it
+    Mark getMark() const { return top; }
+    void rewind(const Mark &mark) { top = mark; }
+
+    void reset(std::size_t minCapacity = 0); // frees all allocations, merging blocks into one which holds them all
+    std::size_t getCapacity() const;
+
+    template <typename Function>
+    void forEachBlock(Function function) const {
+        for (const Block &block : blocks)
+            function(static_cast<const void *>(block.data), block.size);
+    }
+};
+
+#endif
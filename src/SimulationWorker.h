@@ -0,0 +1,227 @@
+#ifndef SIMULATION_WORKER_H
+#define SIMULATION_WORKER_H
+
+#include <glm/glm.hpp>
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "Simulator.h"
+
+struct FrameQueueStats {
+    int depth = 0; // number of frames simulated ahead of the displayed one
+    int lookAheadDepth = 0; // max depth
+    long long numProducerStalls = 0; // number of waits of the simulation for a free frame (the display is too slow)
+    double producerStallTime = 0.0;
+    long long numConsumerStalls = 0; // number of displayed frames without a new simulated frame (the simulation is too slow)
+    long long numDroppedFrames = 0; // frames simulated before requests and never displayed
+};
+
+struct SimulationFrame {
+    std::vector<glm::vec3> positions; // positions of fluid particles
+    int numFluidParticles = 0;
+    bool isPaused = true;
+
+    // statistics of the call of simulate() which produced the frame
+    int numSubsteps = 0;
+    int numActiveParticles = 0;
+    int numIterationUsed = 0;
+    int numNeighbourSearchesUsed = 0;
+    float averageDensityError = 0.0f;
+    float maxDensityError = 0.0f;
+    float solverTime = 0.0f;
+    PhaseTimes phaseTimes;
+    std::vector<ThreadTime> threadTimes;
+    double simulatedTime = 0.0;
+    double wallClockTime = 0.0;
+    long long numParticleUpdates = 0;
+
+    int generation = 0; // number of requests run by the worker before the frame
+    long long numProducerStalls = 0; // number of waits of the worker for a free frame before the frame
+    double producerStallTime = 0.0; // wall-clock time of those waits
+
+    void capture(const Simulator &simulator) {
+        positions.assign(simulator.positions.begin(), simulator.positions.begin() + simulator.numFluidParticles);
+        numFluidParticles = simulator.numFluidParticles;
+        isPaused = simulator.isPaused;
+
+        numSubsteps = simulator.numSubsteps;
+        numActiveParticles = simulator.numActiveParticles;
+        numIterationUsed = simulator.numIterationUsed;
+        numNeighbourSearchesUsed = simulator.numNeighbourSearchesUsed;
+        averageDensityError = simulator.averageDensityError;
+        maxDensityError = simulator.maxDensityError;
+        solverTime = simulator.solverTime;
+        phaseTimes = simulator.phaseTimes;
+        threadTimes = simulator.threadTimes;
+        simulatedTime = simulator.simulatedTime;
+        wallClockTime = simulator.wallClockTime;
+        numParticleUpdates = simulator.numParticleUpdates;
+    }
+};
+
+// runs the simulator on its own thread, up to lookAheadDepth frames ahead of the render loop
+class SimulationWorker {
+private:
+    Simulator &simulator;
+    std::thread thread;
+
+    // ring buffer of frames with one producer (the worker) and one consumer (the render loop):
+    // frames [numConsumedFrames, numProducedFrames) are queued and frame numConsumedFrames - 1 is displayed,
+    // so lookAheadDepth + 1 frames are never overwritten while they are read
+    const int lookAheadDepth;
+    std::vector<SimulationFrame> frames;
+    std::atomic<long long> numProducedFrames{ 0 };
+    std::atomic<long long> numConsumedFrames{ 0 };
+    int frontIndex = 0;
+
+    std::atomic<int> generation{ 0 }; // frames of earlier generations are dropped if a newer frame is queued
+    long long numProducerStalls = 0; // written by the worker and passed to the render loop with frames
+    double producerStallTime = 0.0;
+    long long numConsumerStalls = 0; // written by the render loop
+    long long numDroppedFrames = 0;
+
+    std::mutex mutex; // guards requests and the conditions the worker waits for (held only briefly by both threads)
+    std::condition_variable wakeUp;
+    std::vector<std::function<void(Simulator &)>> requests; // changes of the simulator run by the worker between frames
+    bool stopRequested = false;
+
+    bool hasFreeFrame() const {
+        return numProducedFrames.load() - numConsumedFrames.load() < lookAheadDepth;
+    }
+
+    void run() {
+        while (true) {
+            std::vector<std::function<void(Simulator &)>> pendingRequests;
+
+            {
+                // wait while paused or while the queue is full (back-pressure from the render loop)
+                std::unique_lock<std::mutex> lock(mutex);
+                bool stalled = !simulator.isPaused && !hasFreeFrame();
+                double stallStartTime = omp_get_wtime();
+
+                wakeUp.wait(lock, [this] {
+                    return stopRequested || (hasFreeFrame() && (!requests.empty() || !simulator.isPaused));
+                });
+
+                if (stalled) {
+                    ++numProducerStalls;
+                    producerStallTime += omp_get_wtime() - stallStartTime;
+                }
+
+                if (stopRequested)
+                    break;
+
+                pendingRequests.swap(requests);
+            }
+
+            if (pendingRequests.empty())
+                simulator.simulate();
+            else {
+                for (std::function<void(Simulator &)> &request : pendingRequests)
+                    request(simulator);
+
+                // queued frames no longer show the state of the simulator
+                ++generation;
+            }
+
+            publish();
+        }
+    }
+
+    void publish() {
+        long long numFrames = numProducedFrames.load();
+        SimulationFrame &frame = frames[numFrames % frames.size()];
+        frame.capture(simulator);
+        frame.generation = generation.load();
+        frame.numProducerStalls = numProducerStalls;
+        frame.producerStallTime = producerStallTime;
+
+        numProducedFrames.store(numFrames + 1);
+    }
+
+public:
+    SimulationWorker(Simulator &simulator, int lookAheadDepth)
+        : simulator(simulator), lookAheadDepth(glm::max(lookAheadDepth, 1)), frames(this->lookAheadDepth + 1) {}
+
+    ~SimulationWorker() {
+        stop();
+    }
+
+    void start() {
+        frames[frontIndex].capture(simulator);
+        numProducedFrames = 1;
+        numConsumedFrames = 1;
+        stopRequested = false;
+        thread = std::thread(&SimulationWorker::run, this);
+    }
+
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopRequested = true;
+        }
+        wakeUp.notify_one();
+
+        if (thread.joinable())
+            thread.join();
+    }
+
+    void request(std::function<void(Simulator &)> request) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            requests.push_back(std::move(request));
+        }
+        wakeUp.notify_one();
+    }
+
+    // makes the next queued frame the front frame (returns false if the queue is empty)
+    bool acquireFrame() {
+        long long numConsumed = numConsumedFrames.load();
+        long long numQueued = numProducedFrames.load() - numConsumed;
+        if (numQueued == 0) {
+            if (!getFrame().isPaused)
+                ++numConsumerStalls;
+            return false;
+        }
+
+        // skip frames simulated before the last request
+        int currentGeneration = generation.load();
+        while (numQueued > 1 && frames[numConsumed % frames.size()].generation < currentGeneration) {
+            ++numConsumed;
+            --numQueued;
+            ++numDroppedFrames;
+        }
+
+        frontIndex = numConsumed % frames.size();
+        numConsumedFrames.store(numConsumed + 1);
+
+        // the lock orders the update of the queue before the worker checks its wait condition
+        { std::lock_guard<std::mutex> lock(mutex); }
+        wakeUp.notify_one();
+
+        return true;
+    }
+
+    const SimulationFrame &getFrame() const {
+        return frames[frontIndex];
+    }
+
+    FrameQueueStats getQueueStats() const {
+        FrameQueueStats stats;
+        stats.depth = numProducedFrames.load() - numConsumedFrames.load();
+        stats.lookAheadDepth = lookAheadDepth;
+        stats.numProducerStalls = getFrame().numProducerStalls;
+        stats.producerStallTime = getFrame().producerStallTime;
+        stats.numConsumerStalls = numConsumerStalls;
+        stats.numDroppedFrames = numDroppedFrames;
+        return stats;
+    }
+};
+
+#endif
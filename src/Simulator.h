@@ -5,9 +5,16 @@
 
 #include <glm/glm.hpp>
 
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <initializer_list>
+#include <limits>
 #include <vector>
 
 #include "Kernel.h"
+#include "ScratchArena.h"
+#include "Threading.h"
 
 enum class SceneType {
     DEFAULT,
@@ -15,32 +22,300 @@ enum class SceneType {
     SPOUT
 };
 
+enum class SolverType {
+    PBF,
+    XPBD, // small steps with a single constraint iteration each
+    DFSPH,
+    IISPH
+};
+
+enum class IterationMethod {
+    JACOBI,
+    GAUSS_SEIDEL // graph-coloured by grid cells
+};
+
+template <int n>
+struct Power {
+    static float of(float x) { return x * Power<n - 1>::of(x); }
+};
+
+template <>
+struct Power<0> {
+    static float of(float) { return 1.0f; }
+};
+
+enum class LoadBalancing {
+    STATIC, // equal numbers of particles per thread
+    NEIGHBOUR_COUNT, // contiguous ranges of particles with equal numbers of neighbours per thread
+    DYNAMIC // chunks of particles taken by idle threads
+};
+
+struct alignas(64) ThreadTime { // aligned to a cache line, so threads do not share lines
+    double busy = 0.0; // time spent in balanced loops
+    double idle = 0.0; // time spent waiting at barriers after balanced loops
+};
+
+// state of the automatic choice of the number of threads
+struct ThreadTuning {
+    int numParticles = 0; // fluid particles the number of threads was chosen for (0 before the first choice)
+    std::vector<int> candidates; // numbers of threads still being timed (empty once one is chosen)
+    std::vector<double> substepTimes; // wall-clock time per substep with each candidate
+    int candidate = 0; // candidate timed in the current frame
+    int numFrames = 0; // frames simulated with the candidate
+    int numSubsteps = 0; // substeps of the timed frames
+    double time = 0.0; // wall-clock time of the timed frames
+};
+
+struct PhaseTimes {
+    float prediction = 0.0f; // gravity, prediction of positions and update of velocities
+    float neighbourSearch = 0.0f;
+    float solve = 0.0f; // density constraints or pressure solve
+    float velocityCorrection = 0.0f; // vorticity confinement and XSPH viscosity
+    float bookkeeping = 0.0f; // active particles, sleeping and the max speed
+};
+
+struct ArrayPages {
+    const char *name = "";
+    std::size_t numBytes = 0;
+    std::size_t numHugePageBytes = 0; // bytes on huge pages
+};
+
+struct HugePageReport {
+    bool available = false; // whether the page sizes of arrays are known
+    std::size_t hugePageSize = 0;
+    std::vector<ArrayPages> arrays; // particle and grid arrays, and neighbour lists
+};
+
+struct NumaReport {
+    bool available = false; // whether the NUMA nodes of pages and threads are known
+    int numNodes = 0;
+    std::vector<std::size_t> pagesOnNodes; // pages of fluid particle arrays on each NUMA node
+    std::size_t numLocalPages = 0; // pages of the partitions of threads which are on the nodes of those threads
+    std::size_t numPages = 0;
+};
+
+enum class HaloField {
+    POSITIONS,
+    DENSITIES_AND_LAMBDAS,
+    VELOCITIES,
+    VORTICITY_DELTA_VELOCITIES
+};
+
+class Simulator;
+
+// exchange of particles between the subdomains of a domain-decomposed simulation (called by one thread of the parallel region)
+class HaloExchange {
+public:
+    virtual ~HaloExchange() = default;
+    virtual void migrate(Simulator &simulator) = 0; // moves owned particles which left the subdomain and rebuilds ghost particles
+    virtual void exchange(Simulator &simulator, HaloField field) = 0; // updates a field of ghost particles from their owners
+    virtual bool isConnected() const = 0; // false once the connection to a neighbour is lost (the simulation stops)
+};
+
+// particles at origin + i * steps[0] + j * steps[1] + k * steps[2] for (i, j, k) in [begin, end),
+// in the order of loops over i, j and k (rows of particles along k)
+struct ParticleLattice {
+    glm::ivec3 begin;
+    glm::ivec3 end;
+    glm::vec3 origin;
+    glm::vec3 steps[3];
+    float margin = 0.0f; // particles are created within margin of the subdomain
+
+    int getNumRows() const {
+        return glm::max(end.x - begin.x, 0) * glm::max(end.y - begin.y, 0);
+    }
+
+    glm::vec3 getPosition(int i, int j, int k) const {
+        return origin + static_cast<float>(i) * steps[0] + static_cast<float>(j) * steps[1] + static_cast<float>(k) * steps[2];
+    }
+};
+
+// boundary particles of the last reset with the inputs they depend on, reused while only the fluid changes
+struct BoundaryCache {
+    bool valid = false;
+    glm::ivec3 containerSize;
+    glm::vec3 containerCornerPosition;
+    float particleRadius = 0.0f;
+    float kernelRadius = 0.0f;
+    float restDensity = 0.0f;
+    glm::vec3 subdomainMin;
+    glm::vec3 subdomainMax;
+
+    std::vector<glm::vec3> positions;
+    std::vector<float> psis;
+};
+
+struct ClusterLevel {
+    int clusterSize = 1; // number of grid cells per axis in a cluster
+    float kernelScale = 1.0f; // ratio of the fine kernel radius to the kernel radius of this level
+    int searchRange = 1; // number of clusters per axis on each side within the kernel radius of this level
+    glm::ivec3 gridSize;
+    int gridSizeYZ = 0;
+    int gridSizeXYZ = 0;
+
+    std::vector<glm::vec3> positions; // mass centres of fluid clusters
+    std::vector<float> masses; // masses of fluid clusters
+    std::vector<glm::vec3> boundaryPositions; // mass centres of boundary clusters
+    std::vector<float> boundaryMasses; // psi values of boundary clusters
+    std::vector<float> densities;
+    std::vector<float> lambdas;
+    std::vector<glm::vec3> deltaPositions; // corrections of positions in one iteration
+    std::vector<glm::vec3> sumDeltaPositions; // corrections of positions in all iterations (prolongated to fine particles)
+};
+
+// particles of grid cells, sorted by cell and by index within cells
+struct ParticleGrid {
+    std::vector<int, FirstTouchAllocator<int>> cellBegins; // first particle of each cell in particles (and the end)
+    std::vector<int, FirstTouchAllocator<int>> particles;
+
+    Span<const int> operator[](int cell) const {
+        return Span<const int>(particles.data() + cellBegins[cell], cellBegins[cell + 1] - cellBegins[cell]);
+    }
+};
+
 class Simulator {
 public:
-    using vector2d_int = std::vector<std::vector<int>>;
+    template <typename T>
+    using particle_vector = std::vector<T, FirstTouchAllocator<T>>; // first touched by the threads which update the particles
 
     SceneType sceneType = SceneType::DEFAULT;
 
     bool isPaused = true;
 
+    SolverType solverType = SolverType::PBF;
+
+    IterationMethod iterationMethod = IterationMethod::JACOBI;
     int numIteration = 4;
 
+    bool adaptiveIteration = false; // stop solving density constraints once the density error is small enough
+    int minNumIteration = 2;
+    int maxNumIteration = 20;
+    float densityErrorThreshold = 0.01f; // threshold of the average density error for adaptive iteration
+    float minDensityErrorReduction = 0.02f; // adaptive iteration also stops once an iteration reduces the error by less than this fraction
+
+    int numIterationUsed = 0; // number of iterations used in the last timestep
+    float averageDensityError = 0.0f; // average density error (|1 - rho / rho0|, the residual of density constraints) after the last correction
+    float maxDensityError = 0.0f; // max density error after the last correction
+    std::vector<float> densityErrors; // average density errors before each iteration and after the last one in the last timestep
+
+    bool warmStartLambdas = false; // start solving from the lambdas accumulated in the last timestep
+    float warmStartFactor = 0.25f; // damping of warm-started lambdas
+    float warmStartTimeStep = 0.0f; // time step in which the accumulated lambdas were computed
+
+    bool chebyshevAcceleration = false; // accelerate Jacobi iterations by the Chebyshev semi-iterative method
+    int chebyshevDelay = 1; // number of plain Jacobi iterations before acceleration
+    float spectralRadius = 0.9f; // estimated spectral radius of Jacobi iterations
+    bool estimateSpectralRadius = false; // estimate the spectral radius from density errors of plain Jacobi iterations
+    float chebyshevOmega = 1.0f; // weight of the current iteration
+
+    float solverTime = 0.0f; // wall-clock time of solving density constraints in the last timestep
+
+    bool multilevelSolve = false; // solve density constraints on coarse clusters of particles before fine iterations
+    int numCoarseLevels = 2; // clusters of level l (from 0) span 2^l grid cells per axis
+    int numCoarseIteration = 2; // iterations on each coarse level
+
+    int numSmallSteps = 8; // substeps per timestep of XPBD
+    float compliance = 6.0e-4f; // compliance of density constraints of XPBD (epsilonCFM = compliance / dt^2 of substeps)
+    int numNeighbourSearchesUsed = 0; // number of neighbour searches in the last timestep of XPBD
+    float maxDisplacement = 0.0f; // max displacement of fluid particles since the last neighbour search
+
+    float sphRestDensity = 0.0f; // rest density of pressure solvers (density of the initial particle lattice)
+    float boundaryMassScale = 0.0f; // scale of psi values for pressure solvers
+    bool divergenceFreeSolve = true; // apply the divergence-free solver of DFSPH
+    int maxPressureIteration = 100;
+    float pressureErrorThreshold = 0.001f; // threshold of the average density error of pressure solvers
+    float divergenceErrorThreshold = 0.01f; // threshold of the average density change per timestep of the divergence-free solver
+    int numDivergenceIterationUsed = 0;
+    float relaxationIISPH = 0.5f; // relaxation factor of Jacobi iterations of IISPH
+
+    bool particleSleeping = false; // skip fluid particles in quiescent grid cells (PBF only)
+    float sleepVelocityThreshold = 0.1f;
+    float sleepDensityErrorThreshold = 0.01f;
+    int numSleepSteps = 30; // number of quiescent steps before a cell falls asleep
+    int numSleepingParticles = 0;
+
+    bool multiRate = false; // advance fluid particles in slow grid cells with multiples of the time step (PBF only)
+    int maxTimeLevel = 2; // particles at time level L are updated every 2^L timesteps
+    float multiRateCFLFactor = 0.2f; // max distance travelled per update relative to particleRadius
+    int stepIndex = 0; // number of timesteps since reset
+
+    int numActiveParticles = 0; // number of fluid particles updated in the last timestep
+    long long numParticleUpdates = 0; // number of updates of fluid particles since reset
+
+    bool fusedPostSolve = true; // apply vorticity confinement and XSPH viscosity in one parallel region with one velocity update
+    bool exactPostSolveOrdering = true; // XSPH sees velocities corrected by vorticity confinement (otherwise one neighbour traversal gathers both)
+
+    LoadBalancing loadBalancing = LoadBalancing::NEIGHBOUR_COUNT; // distribution of neighbour loops over threads
+    int dynamicChunkSize = 64; // number of particles per chunk of dynamic load balancing
+    std::vector<ThreadTime> threadTimes; // busy and idle time of threads in the last call of simulate()
+
+    int numThreads = 0; // threads of the parallel regions of the simulator (0 for the OpenMP default)
+    ThreadAffinity threadAffinity = ThreadAffinity::NONE; // pinning of threads to processors (particle arrays are placed at reset)
+    ThreadAffinity pinnedThreadAffinity = ThreadAffinity::NONE; // affinity applied to the threads of the last parallel region
+    int pinnedNumThreads = 0; // number of threads of the last parallel region
+
+    // automatic number of threads: frames are timed with 1, 2, 4, ... threads up to maxAutoNumThreads, and the fastest
+    // one is set to numThreads until the number of fluid particles changes by more than the factor autoTuneParticleRatio
+    bool autoNumThreads = false;
+    int maxAutoNumThreads = 0; // 0 for the OpenMP default
+    int autoTuneWarmupFrames = 1; // frames which are not timed after the number of threads changes
+    int autoTuneFrames = 3; // timed frames per number of threads
+    float autoTuneParticleRatio = 1.5f;
+    ThreadTuning threadTuning;
+
+    // domain decomposition (PBF with Jacobi iterations only): fluid particles in [subdomainMin, subdomainMax) are owned,
+    // and ghost particles of adjacent subdomains follow them as inactive fluid particles
+    HaloExchange *haloExchange = nullptr;
+    glm::vec3 subdomainMin = glm::vec3(-std::numeric_limits<float>::max());
+    glm::vec3 subdomainMax = glm::vec3(std::numeric_limits<float>::max());
+    int numGhostParticles = 0; // ghost particles at the end of the fluid particles
+
+    PhaseTimes phaseTimes; // wall-clock time of phases in the last call of simulate()
+    double phaseStartTime = 0.0;
+
+    // partial results of threads are merged into these inside the parallel region (zero between reductions)
+    float reductionSum = 0.0f;
+    float reductionMax = 0.0f;
+    int reductionCount = 0;
+
+    // deterministic mode gives the same results for any number of threads: terms of sums are kept per particle
+    // and added in fixed blocks of particles in index order, instead of in partial sums of threads
+    bool deterministic = false;
+    static const int reductionBlockSize = 1024;
+    std::vector<float> reductionBlockSums;
+
+    double simulatedTime = 0.0; // simulated time since reset
+    double wallClockTime = 0.0; // wall-clock time spent in simulate() since reset
+    float resetTime = 0.0f; // wall-clock time of the last reset
+
     float restDensity = 6378.0f;
     float invRestDensity = 1.0f / restDensity;
     float invRestDensity2 = invRestDensity * invRestDensity;
-    float massFactor = glm::pi<float>() / 6.0f;
 
     glm::vec3 gravity = { 0.0f, -9.80665f, 0.0f };
     float epsilonCFM = 600.0f; // CFM parameter
     float c = 0.000001f; // artificial viscosity
-    float sCorr = -0.0016f; // artificial pressure strength
+    float sCorr = -1.0e-4f; // -k for the strength k of artificial pressure (its value at the distance delta q)
+    float sCorrDeltaQFactor = 0.2f; // delta q of artificial pressure relative to kernelRadius
+    static const int sCorrExponent = 4; // exponent n of artificial pressure
+    float invWDeltaQ = 0.0f; // reciprocal of the kernel value at delta q
     float epsilonVC = 1.0e-6f; // vorticity confinement parameter
 
     float kernelRadius = 0.1f;
+    Kernel kernel;
 
-    float timeStep = 0.0f;
+    float frameTime = 0.0f; // simulated time advanced by each call of simulate()
+    float timeStep = 0.0f; // time step of the current substep
     float invTimeStep = 0.0f;
 
+    bool adaptiveTimeStep = false; // choose time steps by the CFL condition and split frames into substeps
+    float cflFactor = 0.4f; // max distance travelled per substep relative to particleRadius
+    float minTimeStep = 0.0001f;
+    float maxTimeStep = 0.02f;
+
+    int numSubsteps = 0; // number of substeps in the last frame
+    float maxVelocity = 0.0f; // max speed of fluid particles after the last substep
+
     float particleRadius = 0.0f;
     float particleDiameter = 0.0f;
     float neighbourDistance = 0.0f;
@@ -57,18 +332,36 @@ public:
     int numBoundaryParticles = 0;
     int numParticles = 0;
 
-    std::vector<glm::vec3> positions; // positions of fluid particles and fixed boundary particles
+    particle_vector<glm::vec3> positions; // positions of fluid particles and fixed boundary particles
     glm::vec3 positionMin;
     glm::vec3 positionMax;
 
-    std::vector<glm::vec3> lastPositions; // positions of fluid particles in the last timestep
-    std::vector<glm::vec3> velocities; // velocities of fluid particles
-    std::vector<float> densities; // densities of fluid particles
-    std::vector<float> lambdas; // lambda values of fluid particles
-    std::vector<glm::vec3> deltaPositions; // correction of positions of fluid particles
-    std::vector<glm::vec3> deltaVelocities; // correction of velocities of fluid particles (for applying vorticity confinement and XPSH viscosity)
-
-    std::vector<float> psis; // psi values of boundary particles
+    particle_vector<glm::vec3> lastPositions; // positions of fluid particles in the last timestep
+    particle_vector<glm::vec3> searchPositions; // positions of fluid particles at the last neighbour search (for XPBD)
+    particle_vector<glm::vec3> velocities; // velocities of fluid particles
+    particle_vector<float> densities; // densities of fluid particles
+    particle_vector<float> lambdas; // lambda values of fluid particles
+    particle_vector<float> accumulatedLambdas; // sum of lambda values of fluid particles over all iterations (for warm starting)
+    particle_vector<glm::vec3> deltaPositions; // correction of positions of fluid particles
+    particle_vector<glm::vec3> previousPositions; // positions of fluid particles before the last iteration (for Chebyshev acceleration)
+    particle_vector<glm::vec3> deltaVelocities; // correction of velocities of fluid particles (for applying vorticity confinement and XPSH viscosity)
+    particle_vector<glm::vec3> vorticityDeltaVelocities; // correction of velocities by vorticity confinement (for the fused post-solve pass)
+
+    particle_vector<float> factors; // reciprocal of the squared norm of density gradients of fluid particles (DFSPH)
+    particle_vector<float> kappas; // stiffness values divided by densities of fluid particles (DFSPH)
+    particle_vector<float> pressures; // pressures of fluid particles (IISPH)
+    particle_vector<float> densityAdvections; // densities of fluid particles predicted by non-pressure forces (IISPH)
+    particle_vector<glm::vec3> pressureAccelerations; // pressure accelerations of fluid particles (IISPH)
+
+    particle_vector<unsigned char> sleeping; // whether fluid particles are asleep
+    particle_vector<unsigned char> timeLevels; // time levels of fluid particles
+    particle_vector<unsigned char> inactive; // whether fluid particles are skipped in this timestep (asleep or between updates of their time levels)
+    particle_vector<float> elapsedTimes; // time since the last update of fluid particles
+    particle_vector<float> particleTimeSteps; // time steps of fluid particles in this timestep (zero if inactive)
+
+    particle_vector<float> reductionTerms; // terms of sums of fluid particles in deterministic mode
+
+    particle_vector<float> psis; // psi values of boundary particles
 
     float gridCellSize = 0.0f;
     float invGridCellSize = 0.0f;
@@ -77,14 +370,38 @@ public:
     glm::ivec3 gridSize;
     int gridSizeYZ = 0;
     int gridSizeXYZ = 0;
-    vector2d_int fluidGrid;
-    vector2d_int boundaryGrid;
-
-    vector2d_int neighbourIndices; // indices of neighbours of particles
+    ParticleGrid fluidGrid;
+    ParticleGrid boundaryGrid;
+    particle_vector<int> gridParticleCells; // cell of each particle of the last grid update (-1 outside the grid)
+    particle_vector<int> gridSortedParticles; // particles of the last grid update sorted by x-slabs of cells
+    std::vector<int> gridSlabOffsets; // next position of each thread in each x-slab during the sort
+    std::vector<int> gridSlabBegins; // first sorted particle of each x-slab
+    particle_vector<int> cellQuiescentSteps; // number of consecutive quiescent steps of grid cells (-1 for cells exceeding thresholds)
+    particle_vector<int> cellTimeLevels; // time levels of grid cells
+
+    particle_vector<Span<int>> neighbourIndices; // indices of neighbours of particles (in the neighbour arenas)
+    std::vector<int> particleRangeBegins; // first fluid particle of each thread (and the end) for neighbour-count load balancing
+
+    std::vector<ClusterLevel> clusterLevels; // coarse levels of multilevel solving
+
+    // temporaries of a call of simulate() are allocated from the arena of their thread, or from the shared one in single
+    // constructs, so steps do not allocate from the heap once the arenas are large enough
+    std::vector<ScratchArena> threadArenas;
+    ScratchArena sharedArena;
+    std::vector<ScratchArena> neighbourArenas; // neighbour lists found by each thread in the last neighbour search
+
+#if defined(_DEBUG)
+    // steps after the warm-up must not allocate from the heap, not even for blocks of arenas
+    int allocationWarmupFrames = 10;
+    int numSteadyFrames = 0; // frames since the last reset or change of the number of threads
+    long long numStepHeapAllocations = 0; // heap allocations of the threads of the last call of simulate()
+#endif
+
+    BoundaryCache boundaryCache;
 
     Simulator(SceneType sceneType, float timeStep, float particleRadius, const glm::ivec3 &fluidSize, const glm::vec3 &fluidCornerPosition,
         const glm::ivec3 &containerSize, const glm::vec3 &containerCornerPosition) :
-        sceneType(sceneType), timeStep(timeStep), particleRadius(particleRadius),
+        sceneType(sceneType), frameTime(timeStep), timeStep(timeStep), particleRadius(particleRadius),
         fluidSize(fluidSize), fluidCornerPosition(fluidCornerPosition),
         containerSize(containerSize), containerCornerPosition(containerCornerPosition) {
         reset();
@@ -94,453 +411,2364 @@ public:
         if (isPaused)
             return;
 
-        // apply gravity
-        applyGravity();
+        double startTime = omp_get_wtime();
 
-        // predict positions
-        predictPositions();
+        numSubsteps = 0;
+        float remainingTime = frameTime;
 
-        // find neighbours of fluid particles
-        updateGrid(positions, 0, numFluidParticles, fluidGrid);
-        findNeighbours(positions, neighbourIndices, 0, numFluidParticles, { &fluidGrid, &boundaryGrid });
+        if (autoNumThreads)
+            chooseNumThreads();
 
-        // solve density constraints
-        for (int iter = 0; iter < numIteration; ++iter) {
-            // calculate densities
-            calculateDensities();
+        phaseTimes = PhaseTimes();
+        phaseStartTime = startTime;
+        threadTimes.assign(getNumThreads(), ThreadTime());
+        resetArenas();
 
-            // calculate lambdas
-            calculateLambdas();
+        bool pinThreads = updatePinnedThreads();
 
-            // calculate corrections of positions
-            calculateCorrectionsOfPositions();
+#if defined(_DEBUG)
+        numStepHeapAllocations = 0;
+#endif
 
-            // correct positions
-            correctPositions();
-        }
+        // one team of threads runs all passes of all substeps, so threads are only synchronized between dependent passes
+        #pragma omp parallel default(shared) num_threads(getNumThreads())
+        {
+#if defined(_DEBUG)
+            long long threadHeapAllocations = Threading::getNumAllocations();
+#endif
+
+            if (pinThreads)
+                Threading::pinThread(threadAffinity, omp_get_thread_num());
+
+            // the tolerance avoids a tiny extra substep caused by rounding errors
+            while (remainingTime > 1.0e-4f * frameTime) {
+                // choose the time step of the substep
+                #pragma omp single
+                {
+                    if (adaptiveTimeStep) {
+                        float cflTimeStep = glm::clamp(cflFactor * particleRadius / glm::max(maxVelocity, 1.0e-6f), minTimeStep, maxTimeStep);
+                        setTimeStep(remainingTime / glm::ceil(remainingTime / cflTimeStep)); // split the remaining time evenly
+                    } else
+                        setTimeStep(remainingTime);
+                }
 
-        // predict velocities
-        predictVelocities();
+                step();
 
-        // applying vorticity confinement
-        applyVorticityConfinement();
+                #pragma omp single
+                {
+                    remainingTime -= timeStep;
+                    ++numSubsteps;
+                }
+            }
 
-        // applying XSPH viscosity
-        applyXSPHViscosity();
-    }
+#if defined(_DEBUG)
+            threadHeapAllocations = Threading::getNumAllocations() - threadHeapAllocations;
 
-    void pause() { isPaused = !isPaused; }
+            #pragma omp atomic
+            numStepHeapAllocations += threadHeapAllocations;
+#endif
+        }
 
-    void reset() {
-        isPaused = true;
+#if defined(_DEBUG)
+        // messages of the halo exchange are allocated by the transport
+        ++numSteadyFrames;
+        assert(numSteadyFrames <= allocationWarmupFrames || haloExchange != nullptr || numStepHeapAllocations == 0);
+#endif
 
-        // set time step
-        setTimeStep();
+        // ghost particles can no longer be updated, so the simulation stops
+        if (isHaloLost())
+            isPaused = true;
 
-        // set radius and kernel
-        setRadius();
-        Kernel::setKernelRadius(kernelRadius);
+        double time = omp_get_wtime() - startTime;
+        if (autoNumThreads)
+            timeNumThreads(time);
 
-        // set mass of a fluid particl
-        setMass();
+        simulatedTime += frameTime;
+        wallClockTime += time;
+    }
 
-        // create fluid particles
-        createFluidParticles(fluidSize, fluidCornerPosition, containerSize, containerCornerPosition);
+    void step() {
+        // choose fluid particles updated in this timestep
+        updateActiveParticles();
+        endPhase(phaseTimes.bookkeeping);
 
-        // create boundary particles
-        createBoundaryParticles(containerSize, containerCornerPosition);
+        switch (solverType) {
+            case (SolverType::DFSPH):
+                stepDFSPH();
+                break;
+            case (SolverType::IISPH):
+                stepIISPH();
+                break;
+            case (SolverType::XPBD):
+                stepXPBD();
+                break;
+            default:
+                stepPBF();
+        }
 
-        // initialize grid for finding neighbours
-        initializeGrid(containerSize, containerCornerPosition);
+        // put quiescent cells to sleep and wake up cells near active ones
+        if (particleSleeping && solverType == SolverType::PBF)
+            updateSleeping();
+        else
+            wakeAll();
 
-        // find boundary neighbours of boundary particles
-        updateGrid(positions, numFluidParticles, numParticles, boundaryGrid);
-        findNeighbours(positions, neighbourIndices, numFluidParticles, numParticles, { &boundaryGrid });
+        // find the max speed for choosing the next time step
+        if (adaptiveTimeStep)
+            calculateMaxVelocity();
 
-        // set boundary psi values
-        setPsis();
-    }
+        #pragma omp single
+        ++stepIndex;
 
-    void setTimeStep() {
-        invTimeStep = 1.0f / timeStep;
+        endPhase(phaseTimes.bookkeeping);
     }
 
-    void setRadius() {
-        particleDiameter = 2.0f * particleRadius;
-        neighbourDistance = 4.0f * particleRadius;
-        neighbourDistance2 = neighbourDistance * neighbourDistance;
+    void endPhase(float &phaseTime) {
+        // passes end with a barrier, so the master thread arrives here when all threads are done
+        #pragma omp master
+        {
+            double time = omp_get_wtime();
+            phaseTime += static_cast<float>(time - phaseStartTime);
+            phaseStartTime = time;
+        }
     }
 
-    void setMass() {
-        mass = restDensity * massFactor * particleDiameter * particleDiameter * particleDiameter;
-    }
+    void stepPBF() {
+        // apply gravity
+        applyGravity();
 
-    void createFluidParticles(const glm::ivec3 &fluidSize, const glm::vec3 &fluidCornerPosition,
-        const glm::ivec3 &containerSize, const glm::vec3 &containerCornerPosition) {
-        positionMin = containerCornerPosition + particleDiameter;
-        positionMax = positionMin + glm::vec3(containerSize) * particleDiameter;
+        // predict positions
+        predictPositions();
+        endPhase(phaseTimes.prediction);
 
-        positions.clear();
+        // move particles between subdomains and receive ghost particles
+        migrateParticles();
+        if (isHaloLost())
+            return;
 
-        glm::vec3 fluidPosition = containerCornerPosition + particleDiameter + fluidCornerPosition + particleRadius;
+        // find neighbours of fluid particles
+        findFluidNeighbours();
+        endPhase(phaseTimes.neighbourSearch);
 
-        switch (sceneType) {
-            case (SceneType::BILLOW):
-                for (int i = 0; i < fluidSize.x; ++i)
-                    for (int j = 0; j < fluidSize.y; ++j)
-                        for (int k = 0; k < fluidSize.z; ++k)
-                            positions.push_back(fluidPosition + glm::vec3(i, j, k) * particleDiameter);
+        // apply the damped lambdas of the last timestep as the initial guess
+        if (warmStartLambdas)
+            applyWarmStart();
 
-                for (int i = 0; i < 2.0f * fluidSize.x; ++i)
-                    for (int j = 0; j < 0.4f * fluidSize.y; ++j)
-                        for (int k = fluidSize.z; k < 1.5f * fluidSize.z; ++k)
-                            positions.push_back(fluidPosition + glm::vec3(i, j, k) * particleDiameter);
+        // solve density constraints
+        solveDensityConstraints();
+        endPhase(phaseTimes.solve);
 
-                break;
-            case (SceneType::SPOUT):
-                for (int i = 0; i < 3.0f * fluidSize.x; ++i)
-                    for (int j = 0; j < 0.2f * fluidSize.y; ++j)
-                        for (int k = 0; k < 2.0f * fluidSize.z; ++k)
-                            positions.push_back(fluidPosition + glm::vec3(i, j, k) * particleDiameter);
-
-                for (int i = 1.3f * fluidSize.x; i < 1.7f * fluidSize.x; ++i)
-                    for (int j = 0.4f * fluidSize.y; j < 2.4f * fluidSize.y; ++j)
-                        for (int k = 0.8f * fluidSize.z; k < 1.2f * fluidSize.z; ++k) {
-                            glm::vec3 position = fluidPosition + glm::vec3(i, j, k) * particleDiameter;
-                            position.x = containerCornerPosition.x + containerSize.x * particleDiameter + particleRadius - i * particleDiameter;
-                            positions.push_back(position);
-                        }
+        // predict velocities
+        predictVelocities();
+        exchangeHalo(HaloField::VELOCITIES);
+        endPhase(phaseTimes.prediction);
 
-                break;
-            default:
-                for (int i = 0; i < fluidSize.x; ++i)
-                    for (int j = 0; j < fluidSize.y; ++j)
-                        for (int k = 0; k < fluidSize.z; ++k)
-                            positions.push_back(fluidPosition + glm::vec3(i, j, k) * particleDiameter);
-        }
+        // applying vorticity confinement and XSPH viscosity
+        applyVelocityCorrections();
+        endPhase(phaseTimes.velocityCorrection);
+    }
 
-        numFluidParticles = positions.size();
+    void stepXPBD() {
+        const float smallTimeStep = timeStep / numSmallSteps;
+        const float neighbourSkin = neighbourDistance - kernelRadius;
 
-        lastPositions.clear();
-        lastPositions.assign(positions.begin(), positions.begin() + numFluidParticles);
+        #pragma omp master
+        {
+            numIterationUsed = 0;
+            numNeighbourSearchesUsed = 0;
+            densityErrors.clear();
+            solverTime = 0.0f;
+        }
 
-        velocities.clear();
-        velocities.resize(numFluidParticles);
+        setParticleTimeSteps(smallTimeStep);
 
-        densities.clear();
-        densities.resize(numFluidParticles);
+        // epsilonCFM of a single XPBD iteration from zero lambdas
+        const float epsilon = compliance / (smallTimeStep * smallTimeStep);
 
-        lambdas.clear();
-        lambdas.resize(numFluidParticles);
+        for (int substep = 0; substep < numSmallSteps; ++substep) {
+            // apply gravity
+            applyGravity();
 
-        deltaPositions.clear();
-        deltaPositions.resize(numFluidParticles);
+            // predict positions
+            predictPositions();
+            endPhase(phaseTimes.prediction);
 
-        deltaVelocities.clear();
-        deltaVelocities.resize(numFluidParticles);
-    }
+            // find neighbours again only if a particle may have entered the kernel radius of a non-neighbour
+            if (substep == 0 || calculateMaxDisplacement() > 0.5f * neighbourSkin) {
+                findFluidNeighbours();
+                updateSearchPositions();
 
-    void createBoundaryParticles(const glm::ivec3 &containerSize, const glm::vec3 &containerCornerPosition) {
-        glm::vec3 boundaryPosition = containerCornerPosition + particleRadius;
-        for (int i = 0; i < containerSize.x + 2; ++i)
-            for (int j = 0; j < containerSize.y + 2; ++j) {
-                positions.push_back(boundaryPosition + glm::vec3(i, j, 0) * particleDiameter); // back
-                positions.push_back(boundaryPosition + glm::vec3(i, j, containerSize.z + 1) * particleDiameter); // front
+                #pragma omp master
+                ++numNeighbourSearchesUsed;
             }
+            endPhase(phaseTimes.neighbourSearch);
 
-        for (int j = 0; j < containerSize.y + 2; ++j)
-            for (int k = 1; k <= containerSize.z; ++k) {
-                positions.push_back(boundaryPosition + glm::vec3(0, j, k) * particleDiameter); // left
-                positions.push_back(boundaryPosition + glm::vec3(containerSize.x + 1, j, k) * particleDiameter); // right
-            }
+            // solve density constraints with a single iteration
+            double startTime = omp_get_wtime();
+            calculateDensities();
+            calculateLambdas(epsilon);
+            calculateCorrectionsOfPositions();
+            correctPositions();
 
-        for (int i = 1; i <= containerSize.x; ++i)
-            for (int k = 1; k <= containerSize.z; ++k) {
-                positions.push_back(boundaryPosition + glm::vec3(i, 0, k) * particleDiameter); // bottom
-                positions.push_back(boundaryPosition + glm::vec3(i, containerSize.y + 1, k) * particleDiameter); // top
+            #pragma omp master
+            {
+                densityErrors.push_back(averageDensityError);
+                solverTime += static_cast<float>(omp_get_wtime() - startTime);
+                ++numIterationUsed;
             }
+            endPhase(phaseTimes.solve);
 
-        numParticles = positions.size();
-        numBoundaryParticles = numParticles - numFluidParticles;
-
-        psis.clear();
-        psis.resize(numBoundaryParticles);
-    }
-
-    void initializeGrid(const glm::ivec3 &containerSize, const glm::vec3 &containerCornerPosition) {
-        gridCellSize = neighbourDistance;
-        invGridCellSize = 1.0f / gridCellSize;
-        gridCellIndexMin = glm::floor(containerCornerPosition * invGridCellSize) - 1.0f;
-        gridCellIndexMax = glm::floor((containerCornerPosition + glm::vec3(containerSize + 2) * particleDiameter) * invGridCellSize) + 1.0f;
-        gridSize = gridCellIndexMax - gridCellIndexMin + 1;
+            // predict velocities
+            predictVelocities();
+            endPhase(phaseTimes.prediction);
+        }
 
-        gridSizeYZ = gridSize.y * gridSize.z;
-        gridSizeXYZ = gridSize.x * gridSizeYZ;
+        // measure the residual after the last substep
+        calculateDensities(false);
 
-        fluidGrid.clear();
-        fluidGrid.resize(gridSizeXYZ);
+        #pragma omp master
+        densityErrors.push_back(averageDensityError);
+        endPhase(phaseTimes.solve);
 
-        boundaryGrid.clear();
-        boundaryGrid.resize(gridSizeXYZ);
+        // applying vorticity confinement and XSPH viscosity (once per timestep)
+        setParticleTimeSteps(timeStep);
+        applyVelocityCorrections();
+        endPhase(phaseTimes.velocityCorrection);
+    }
 
-        neighbourIndices.clear();
-        neighbourIndices.resize(numParticles);
+    void setParticleTimeSteps(float dt) {
+        #pragma omp for schedule(static)
+        for (int i = 0; i < numFluidParticles; ++i)
+            particleTimeSteps[i] = dt;
     }
 
-    void updateGrid(const std::vector<glm::vec3> &positions, int rangeBegin, int rangeEnd, vector2d_int &grid) {
+    float calculateMaxDisplacement() {
+        float threadMaxDisplacement2 = 0.0f;
 
-        for (auto &cell : grid)
-            cell.clear();
+        #pragma omp for schedule(static) nowait
+        for (int i = 0; i < numFluidParticles; ++i) {
+            glm::vec3 displacement = positions[i] - searchPositions[i];
+            threadMaxDisplacement2 = glm::max(threadMaxDisplacement2, glm::dot(displacement, displacement));
+        }
 
-        for (int i = rangeBegin; i < rangeEnd; ++i) {
-            glm::ivec3 gridCellIndex = glm::floor(positions[i] * invGridCellSize); // absolute index
-            if (glm::all(glm::greaterThanEqual(gridCellIndex, gridCellIndexMin)) &&
-                glm::all(glm::lessThanEqual(gridCellIndex, gridCellIndexMax))) {
-                gridCellIndex -= gridCellIndexMin; // relative index
-                grid[gridCellIndex.x * gridSizeYZ + gridCellIndex.y * gridSize.z + gridCellIndex.z].push_back(i);
-            }
+        mergeReduction(0.0f, threadMaxDisplacement2);
+
+        #pragma omp single
+        {
+            maxDisplacement = glm::sqrt(reductionMax);
+            clearReduction();
         }
+
+        return maxDisplacement;
     }
 
-    void findNeighbours(const std::vector<glm::vec3> &positions, vector2d_int &neighbourIndices,
-        int sourceRangeBegin, int sourceRangeEnd, const std::vector<vector2d_int *> grids) {
-        #pragma omp parallel default(shared)
-            {
-                #pragma omp for schedule(static)
-                for (int i = sourceRangeBegin; i < sourceRangeEnd; ++i) {
-                    neighbourIndices[i].clear();
-
-                    const glm::vec3 &pi = positions[i];
-                    const glm::ivec3 sourceCellIndex = glm::floor(pi * invGridCellSize); // absolute index
-
-                    for (int dx = -1; dx < 2; ++dx)
-                        for (int dy = -1; dy < 2; ++dy)
-                            for (int dz = -1; dz < 2; ++dz) {
-                                glm::ivec3 targetCellIndex = sourceCellIndex + glm::ivec3(dx, dy, dz);
-                                if (glm::all(glm::greaterThanEqual(targetCellIndex, gridCellIndexMin)) &&
-                                    glm::all(glm::lessThanEqual(targetCellIndex, gridCellIndexMax))) {
-                                    targetCellIndex -= gridCellIndexMin;
-                                    int targetCellNumber = targetCellIndex.x * gridSizeYZ + targetCellIndex.y * gridSize.z + targetCellIndex.z;
-
-                                    for (auto grid : grids)
-                                        for (int j : (*grid)[targetCellNumber]) {
-                                            glm::vec3 diff = pi - positions[j];
-                                            if (glm::dot(diff, diff) < neighbourDistance2)
-                                                neighbourIndices[i].push_back(j);
-                                        }
-                                }
-                            }
-                }
-            }
+    void addToSum(int i, float term, float &threadSum) {
+        if (deterministic)
+            reductionTerms[i] = term;
+        else
+            threadSum += term;
     }
 
-    void setPsis() {
-        #pragma omp parallel default(shared)
+    void mergeReduction(float threadSum, float threadMax, int threadCount = 0) {
+        // merge partial results of threads (OpenMP 2.0 has no max reduction), which all threads see after the barrier
+        double startTime = omp_get_wtime();
+
+        if (deterministic)
+            sumReductionTerms();
+
+        #pragma omp critical
         {
-            #pragma omp for schedule(static)
-            for (int i = numFluidParticles; i < numParticles; ++i) {
-                const glm::vec3 &pi = positions[i];
-                float &psi = psis[i - numFluidParticles];
-                for (int j : neighbourIndices[i])
-                    psi += Kernel::WPoly6(pi - positions[j]);
-                psi = restDensity / psi;
-            }
+            reductionSum += threadSum;
+            reductionMax = glm::max(reductionMax, threadMax);
+            reductionCount += threadCount;
         }
+
+        #pragma omp barrier
+        threadTimes[omp_get_thread_num()].idle += omp_get_wtime() - startTime;
     }
 
-    void applyGravity() {
-        #pragma omp parallel default(shared)
-        {
-            #pragma omp for schedule(static)
-            for (int i = 0; i < numFluidParticles; ++i) {
-                velocities[i] += timeStep * gravity;
-            }
+    void sumReductionTerms() {
+        int numBlocks = (numFluidParticles + reductionBlockSize - 1) / reductionBlockSize;
+
+        // the implicit barrier waits for the terms of all threads
+        #pragma omp single
+        reductionBlockSums.resize(numBlocks);
+
+        #pragma omp for schedule(static)
+        for (int block = 0; block < numBlocks; ++block) {
+            int blockEnd = glm::min((block + 1) * reductionBlockSize, numFluidParticles);
+            float blockSum = 0.0f;
+            for (int i = block * reductionBlockSize; i < blockEnd; ++i)
+                if (!inactive[i])
+                    blockSum += reductionTerms[i];
+
+            reductionBlockSums[block] = blockSum;
         }
+
+        #pragma omp single
+        for (float blockSum : reductionBlockSums)
+            reductionSum += blockSum;
     }
 
-    void predictPositions() {
-        #pragma omp parallel default(shared)
-        {
-            #pragma omp for schedule(static)
-            for (int i = 0; i < numFluidParticles; ++i) {
-                glm::vec3 &pi = positions[i];
-                glm::vec3 &vi = velocities[i];
-                pi += timeStep * vi;
-
-                if (pi.x < positionMin.x) {
-                    pi.x = positionMin.x + particleDiameter;
-                    vi.x *= -0.5f;
-                } else if (pi.x > positionMax.x) {
-                    pi.x = positionMax.x - particleDiameter;
-                    vi.x *= -0.5f;
-                }
+    void clearReduction() {
+        reductionSum = 0.0f;
+        reductionMax = 0.0f;
+        reductionCount = 0;
+    }
 
-                if (pi.y < positionMin.y) {
-                    pi.y = positionMin.y + particleDiameter;
-                    vi.y *= -0.5f;
-                } else if (pi.y > positionMax.y) {
-                    pi.y = positionMax.y - particleDiameter;
-                    vi.y *= -0.5f;
-                }
+    void updateSearchPositions() {
+        #pragma omp for schedule(static)
+        for (int i = 0; i < numFluidParticles; ++i)
+            searchPositions[i] = positions[i];
+    }
 
-                if (pi.z < positionMin.z) {
-                    pi.z = positionMin.z + particleDiameter;
-                    vi.z *= -0.5f;
-                } else if (pi.z > positionMax.z) {
-                    pi.z = positionMax.z - particleDiameter;
-                    vi.z *= -0.5f;
-                }
-            }
+    void stepDFSPH() {
+        // find neighbours of fluid particles
+        findFluidNeighbours();
+        endPhase(phaseTimes.neighbourSearch);
+
+        // calculate densities and factors
+        calculateDensitiesAndFactors();
+
+        // make the velocity field divergence-free
+        if (divergenceFreeSolve) {
+            int numDivergenceIteration = solvePressureDFSPH(true, divergenceErrorThreshold);
+
+            #pragma omp master
+            numDivergenceIterationUsed = numDivergenceIteration;
         }
-    }
 
-    void calculateDensities() {
-        #pragma omp parallel default(shared)
-        {
-            #pragma omp for schedule(static)
-            for (int i = 0; i < numFluidParticles; ++i) {
-                const glm::vec3 &pi = positions[i];
-                float &density = densities[i];
+        // apply gravity
+        applyGravity();
 
-                density = 0.0f;
+        // make the predicted density constant
+        double startTime = omp_get_wtime();
+        int numPressureIteration = solvePressureDFSPH(false, pressureErrorThreshold);
 
-                for (int j : neighbourIndices[i]) {
-                    float m = j < numFluidParticles ? mass : psis[j - numFluidParticles];
-                    density += m * Kernel::WPoly6(pi - positions[j]);
-                }
-            }
+        #pragma omp master
+        {
+            numIterationUsed = numPressureIteration;
+            solverTime = static_cast<float>(omp_get_wtime() - startTime);
         }
+        endPhase(phaseTimes.solve);
+
+        // update positions (with the same collision handling as predicted positions of PBF)
+        predictPositions();
+        updateLastPositions();
+        endPhase(phaseTimes.prediction);
+
+        // applying vorticity confinement and XSPH viscosity
+        applyVelocityCorrections();
+        endPhase(phaseTimes.velocityCorrection);
     }
 
-    void calculateLambdas() {
-        #pragma omp parallel default(shared)
-        {
-            #pragma omp for schedule(static)
-            for (int i = 0; i < numFluidParticles; ++i) {
-                lambdas[i] = 0.0f;
-                //if (densities[i] < restDensity) // negative Ci
-                //    continue;
+    void stepIISPH() {
+        // find neighbours of fluid particles
+        findFluidNeighbours();
+        endPhase(phaseTimes.neighbourSearch);
 
-                const glm::vec3 &pi = positions[i];
-                float &lambda = lambdas[i];
+        // calculate densities and factors (the diagonal of the pressure Poisson equation is derived from factors)
+        calculateDensitiesAndFactors();
 
-                glm::vec3 gradConstraint(0.0f); // gradient of Ci with respect to pi (without multiplying invRestDensity)
+        // apply gravity
+        applyGravity();
 
-                for (int j : neighbourIndices[i]) {
-                    float m = j < numFluidParticles ? mass : psis[j - numFluidParticles];
-                    glm::vec3 grad = m * Kernel::gradWSpiky(pi - positions[j]);
-                    gradConstraint += grad;
-                    lambda += glm::dot(grad, grad);
-                }
+        // predict densities and initialize pressures
+        calculateDensityAdvections();
 
-                lambda = (1 - densities[i] * invRestDensity) /
-                    (invRestDensity2 * (lambda + glm::dot(gradConstraint, gradConstraint)) + epsilonCFM);
-            }
-        }
-    }
+        // solve the pressure Poisson equation
+        double startTime = omp_get_wtime();
+        int numPressureIteration = solvePressureIISPH();
 
-    void calculateCorrectionsOfPositions() {
-        #pragma omp parallel default(shared)
+        #pragma omp master
         {
-            #pragma omp for schedule(static)
-            for (int i = 0; i < numFluidParticles; ++i) {
-                const glm::vec3 &pi = positions[i];
-                const float &lambdai = lambdas[i];
-                glm::vec3 &deltaPosition = deltaPositions[i];
+            numIterationUsed = numPressureIteration;
+            solverTime = static_cast<float>(omp_get_wtime() - startTime);
+        }
 
-                deltaPosition = glm::vec3(0.0f);
+        // apply pressure accelerations
+        calculatePressureAccelerations();
+        applyPressureAccelerations();
+        endPhase(phaseTimes.solve);
 
-                for (int j : neighbourIndices[i])
-                    if (j < numFluidParticles)
-                        deltaPosition += (lambdai + lambdas[j] + sCorr) * mass * Kernel::gradWSpiky(pi - positions[j]);
-                    else
-                        deltaPosition += (lambdai + sCorr) * psis[j - numFluidParticles] * Kernel::gradWSpiky(pi - positions[j]);
+        // update positions (with the same collision handling as predicted positions of PBF)
+        predictPositions();
+        updateLastPositions();
+        endPhase(phaseTimes.prediction);
 
-                deltaPosition *= invRestDensity;
-            }
-        }
+        // applying vorticity confinement and XSPH viscosity
+        applyVelocityCorrections();
+        endPhase(phaseTimes.velocityCorrection);
     }
 
-    void correctPositions() {
-        #pragma omp parallel default(shared)
+    void solveDensityConstraints() {
+        double startTime = omp_get_wtime();
+
+        #pragma omp master
         {
-            #pragma omp for schedule(static)
-            for (int i = 0; i < numFluidParticles; ++i)
-                positions[i] += deltaPositions[i];
+            numIterationUsed = 0;
+            densityErrors.clear();
         }
-    }
 
-    void predictVelocities() {
-        #pragma omp parallel default(shared)
-        {
-            #pragma omp for schedule(static)
-            for (int i = 0; i < numFluidParticles; ++i) {
-                velocities[i] = invTimeStep * (positions[i] - lastPositions[i]);
-                lastPositions[i] = positions[i];
+        // propagate corrections across long distances first (from the coarsest level)
+        if (multilevelSolve)
+            solveClusterLevels();
+
+        int numIterationMax = adaptiveIteration ? maxNumIteration : numIteration;
+        bool converged = false;
+        float lastDensityError = 0.0f;
+        for (int iter = 0; iter < numIterationMax; ++iter) {
+            // calculate densities (and density errors)
+            calculateDensities();
+
+            #pragma omp master
+            densityErrors.push_back(averageDensityError);
+
+            // stop iterating if converged, or if iterations hardly reduce the error any more
+            if (adaptiveIteration && iter >= minNumIteration && (averageDensityError < densityErrorThreshold ||
+                averageDensityError > (1.0f - minDensityErrorReduction) * lastDensityError)) {
+                converged = true;
+                break;
             }
-        }
-    }
 
-    void applyVorticityConfinement() {
-        #pragma omp parallel default(shared)
-        {
-            #pragma omp for schedule(static)
-            for (int i = 0; i < numFluidParticles; ++i) {
-                const glm::vec3 &pi = positions[i];
-                const glm::vec3 &vi = velocities[i];
-
-                float numFluidNeighbours = 0.0f;
-                glm::vec3 eta(0.0f);
-                glm::vec3 omega(0.0f);
-
-                for (int j : neighbourIndices[i])
-                    if (j < numFluidParticles) {
-                        eta += positions[j];
-                        omega += glm::cross(velocities[j] - vi, Kernel::gradWSpiky(positions[j] - pi));
-                        ++numFluidNeighbours;
-                    }
+            lastDensityError = averageDensityError;
 
-                eta = 0.5f * (eta - numFluidNeighbours * pi);
-                float etaNorm = glm::length(eta);
-                deltaVelocities[i] = etaNorm > 1.0e-6f ? epsilonVC * glm::cross(eta / etaNorm, omega) : glm::vec3(0.0f);
+            #pragma omp master
+            ++numIterationUsed;
+
+            if (iterationMethod == IterationMethod::GAUSS_SEIDEL) {
+                // correct positions in place, cell colour by cell colour
+                solveGaussSeidel();
+                continue;
             }
+
+            // calculate lambdas
+            calculateLambdas();
+            exchangeHalo(HaloField::DENSITIES_AND_LAMBDAS);
+
+            // calculate corrections of positions
+            calculateCorrectionsOfPositions();
+
+            // correct positions
+            if (chebyshevAcceleration)
+                correctPositionsChebyshev(iter);
+            else
+                correctPositions();
+
+            exchangeHalo(HaloField::POSITIONS);
         }
 
-        #pragma omp parallel default(shared)
-        {
-            #pragma omp for schedule(static)
-            for (int i = 0; i < numFluidParticles; ++i)
-                velocities[i] += deltaVelocities[i];
+        // measure the residual after the last correction (the densities of the last iteration are kept for velocity corrections)
+        if (!converged) {
+            calculateDensities(false);
+
+            #pragma omp master
+            densityErrors.push_back(averageDensityError);
+        }
+
+        // the master thread records density errors
+        if (iterationMethod == IterationMethod::JACOBI && chebyshevAcceleration && estimateSpectralRadius) {
+            #pragma omp master
+            updateSpectralRadius();
         }
+
+        #pragma omp master
+        solverTime = static_cast<float>(omp_get_wtime() - startTime);
     }
 
-    void applyXSPHViscosity() {
-        #pragma omp parallel default(shared)
-        {
-            #pragma omp for schedule(static)
-            for (int i = 0; i < numFluidParticles; ++i) {
-                const glm::vec3 &pi = positions[i];
-                const glm::vec3 &vi = velocities[i];
-                glm::vec3 &deltaVelocity = deltaVelocities[i];
+    void pause() { isPaused = !isPaused; }
 
-                deltaVelocity = glm::vec3(0.0f);
+    void switchSolverType() {
+        solverType = solverType == SolverType::PBF ? SolverType::XPBD :
+            solverType == SolverType::XPBD ? SolverType::DFSPH :
+            solverType == SolverType::DFSPH ? SolverType::IISPH : SolverType::PBF;
+    }
 
-                for (int j : neighbourIndices[i])
-                    if (j < numFluidParticles)
-                        //deltaVelocity += (velocities[j] - vi) * Kernel::WPoly6(pi - positions[j]);
-                        deltaVelocity += (velocities[j] - vi) * Kernel::WPoly6(pi - positions[j]) / densities[j];
+    void switchThreadAffinity() {
+        threadAffinity = threadAffinity == ThreadAffinity::NONE ? ThreadAffinity::COMPACT :
+            threadAffinity == ThreadAffinity::COMPACT ? ThreadAffinity::SCATTER : ThreadAffinity::NONE;
+    }
 
-                //deltaVelocity *= c;
-                deltaVelocity *= c * mass;
-            }
-        }
+    void reset() {
+        double startTime = omp_get_wtime();
+        isPaused = true;
 
-        // correct velocities (by applying XSPH viscosity)
-        #pragma omp parallel default(shared)
-        {
-            #pragma omp for schedule(static)
-            for (int i = 0; i < numFluidParticles; ++i)
-                velocities[i] += deltaVelocities[i];
+        // set time step
+        setTimeStep(frameTime);
+        maxVelocity = 0.0f;
+
+        // set radius and kernel
+        setRadius();
+        kernel.setKernelRadius(kernelRadius);
+        setArtificialPressure();
+
+        // set mass of a fluid particl
+        setMass();
+
+        positionMin = containerCornerPosition + particleDiameter;
+        positionMax = positionMin + glm::vec3(containerSize) * particleDiameter;
+
+        // boundary particles and psi values are kept if only the fluid changed
+        bool reuseBoundary = canReuseBoundary();
+
+        // create particles in arrays on the NUMA nodes of the threads which update them
+        allocateParticleArrays(reuseBoundary);
+
+        // initialize grid for finding neighbours
+        initializeGrid(containerSize, containerCornerPosition);
+        resetArenas();
+
+        #pragma omp parallel default(shared) num_threads(getNumThreads())
+        {
+            // find boundary neighbours of boundary particles
+            updateGrid(positions, numFluidParticles, numParticles, boundaryGrid);
+
+            if (!reuseBoundary) {
+                findNeighbours(positions, neighbourIndices, numFluidParticles, numParticles, { &boundaryGrid });
+
+                // set boundary psi values
+                setPsis();
+
+                // lists of boundary particles are freed by the next neighbour search
+                #pragma omp for schedule(static)
+                for (int i = numFluidParticles; i < numParticles; ++i)
+                    neighbourIndices[i] = Span<int>();
+            }
+        }
+
+        if (!reuseBoundary)
+            storeBoundary();
+
+        // set rest density of pressure solvers
+        setSPHRestDensity();
+
+        // coarse levels are rebuilt for the new boundary
+        clusterLevels.clear();
+
+        numGhostParticles = 0;
+        warmStartTimeStep = 0.0f;
+        numSleepingParticles = 0;
+        numActiveParticles = numFluidParticles;
+        numParticleUpdates = 0;
+        stepIndex = 0;
+
+#if defined(_DEBUG)
+        numSteadyFrames = 0;
+#endif
+
+        simulatedTime = 0.0;
+        wallClockTime = 0.0;
+        resetTime = static_cast<float>(omp_get_wtime() - startTime);
+    }
+
+    int getNumThreads() const {
+        return numThreads > 0 ? numThreads : omp_get_max_threads();
+    }
+
+    // frees the temporaries of the last parallel region and gives each thread of the next one an arena
+    void resetArenas() {
+        int numArenas = getNumThreads();
+        if (static_cast<int>(threadArenas.size()) != numArenas) {
+            threadArenas.resize(numArenas);
+            neighbourArenas.resize(numArenas);
+
+#if defined(_DEBUG)
+            numSteadyFrames = 0;
+#endif
+        }
+
+        // threads take different shares of dynamically scheduled loops, so every arena gets the capacity of the largest
+        std::size_t maxCapacity = 0;
+        for (const ScratchArena &arena : threadArenas)
+            maxCapacity = std::max(maxCapacity, arena.getCapacity());
+
+        for (ScratchArena &arena : threadArenas)
+            arena.reset(maxCapacity);
+        sharedArena.reset();
+    }
+
+    // whether threads of the next parallel region must be pinned: threads which join a larger team are not pinned yet
+    bool updatePinnedThreads() {
+        bool pinThreads = threadAffinity != pinnedThreadAffinity ||
+            (threadAffinity != ThreadAffinity::NONE && getNumThreads() != pinnedNumThreads);
+        pinnedThreadAffinity = threadAffinity;
+        pinnedNumThreads = getNumThreads();
+        return pinThreads;
+    }
+
+    // sets numThreads to the candidate of the frame, starting over if the number of fluid particles changed a lot
+    void chooseNumThreads() {
+        int numParticles = glm::max(getNumOwnedParticles(), 1);
+        if (threadTuning.numParticles == 0 || numParticles > threadTuning.numParticles * autoTuneParticleRatio ||
+            numParticles * autoTuneParticleRatio < threadTuning.numParticles) {
+            int maxNumThreads = maxAutoNumThreads > 0 ? maxAutoNumThreads : omp_get_max_threads();
+
+            threadTuning = ThreadTuning();
+            threadTuning.numParticles = numParticles;
+            for (int n = 1; n < maxNumThreads; n *= 2)
+                threadTuning.candidates.push_back(n);
+            threadTuning.candidates.push_back(maxNumThreads);
+            threadTuning.substepTimes.assign(threadTuning.candidates.size(), 0.0);
+        }
+
+        if (!threadTuning.candidates.empty())
+            numThreads = threadTuning.candidates[threadTuning.candidate];
+    }
+
+    // times the frame with the candidate and keeps the fastest number of threads once all candidates are timed
+    void timeNumThreads(double time) {
+        if (threadTuning.candidates.empty())
+            return;
+
+        // the first frames after a change of the number of threads include starting and pinning threads
+        if (++threadTuning.numFrames > autoTuneWarmupFrames) {
+            threadTuning.time += time;
+            threadTuning.numSubsteps += numSubsteps;
+        }
+
+        if (threadTuning.numFrames < autoTuneWarmupFrames + autoTuneFrames)
+            return;
+
+        // substeps of a frame vary with adaptive time steps
+        threadTuning.substepTimes[threadTuning.candidate] = threadTuning.time / glm::max(threadTuning.numSubsteps, 1);
+        threadTuning.numFrames = 0;
+        threadTuning.numSubsteps = 0;
+        threadTuning.time = 0.0;
+
+        if (++threadTuning.candidate < static_cast<int>(threadTuning.candidates.size()))
+            return;
+
+        int fastest = 0;
+        for (int i = 1; i < static_cast<int>(threadTuning.candidates.size()); ++i)
+            if (threadTuning.substepTimes[i] < threadTuning.substepTimes[fastest])
+                fastest = i;
+
+        numThreads = threadTuning.candidates[fastest];
+        threadTuning.candidates.clear();
+    }
+
+    // chooses the number of threads again in the next frames
+    void retuneNumThreads() {
+        threadTuning = ThreadTuning();
+    }
+
+    void setTimeStep(float dt) {
+        timeStep = dt;
+        invTimeStep = 1.0f / timeStep;
+    }
+
+    void setRadius() {
+        particleDiameter = 2.0f * particleRadius;
+        neighbourDistance = 4.0f * particleRadius;
+        neighbourDistance2 = neighbourDistance * neighbourDistance;
+    }
+
+    void setArtificialPressure() {
+        invWDeltaQ = 1.0f / kernel.WPoly6(glm::vec3(sCorrDeltaQFactor * kernelRadius, 0.0f, 0.0f));
+    }
+
+    float calculateArtificialPressure(float rNorm2) const {
+        // s_corr = -k * (W(r) / W(delta q))^n
+        return sCorr * Power<sCorrExponent>::of(kernel.WPoly6(rNorm2) * invWDeltaQ);
+    }
+
+    // sum of kernel values of an interior particle of the initial cubic lattice
+    float sumLatticeKernel() const {
+        float sum = 0.0f;
+        int range = static_cast<int>(glm::ceil(kernelRadius / particleDiameter));
+        for (int i = -range; i <= range; ++i)
+            for (int j = -range; j <= range; ++j)
+                for (int k = -range; k <= range; ++k)
+                    sum += kernel.WPoly6(glm::vec3(i, j, k) * particleDiameter);
+
+        return sum;
+    }
+
+    void setMass() {
+        // the initial lattice is at rest density, so density constraints hold the fluid up without extra repulsion
+        mass = restDensity / sumLatticeKernel();
+    }
+
+    std::vector<ParticleLattice> getFluidLattices() const {
+        glm::vec3 fluidPosition = containerCornerPosition + particleDiameter + fluidCornerPosition + particleRadius;
+        auto ceilIndex = [](float bound) { return static_cast<int>(glm::ceil(bound)); }; // i < bound for integers i < ceilIndex(bound)
+
+        ParticleLattice block;
+        block.begin = glm::ivec3(0);
+        block.end = fluidSize;
+        block.origin = fluidPosition;
+        block.steps[0] = glm::vec3(particleDiameter, 0.0f, 0.0f);
+        block.steps[1] = glm::vec3(0.0f, particleDiameter, 0.0f);
+        block.steps[2] = glm::vec3(0.0f, 0.0f, particleDiameter);
+
+        std::vector<ParticleLattice> lattices;
+
+        switch (sceneType) {
+            case (SceneType::BILLOW):
+                lattices.push_back(block);
+
+                block.begin = glm::ivec3(0, 0, fluidSize.z);
+                block.end = glm::ivec3(ceilIndex(2.0f * fluidSize.x), ceilIndex(0.4f * fluidSize.y), ceilIndex(1.5f * fluidSize.z));
+                lattices.push_back(block);
+
+                break;
+            case (SceneType::SPOUT):
+                block.end = glm::ivec3(ceilIndex(3.0f * fluidSize.x), ceilIndex(0.2f * fluidSize.y), ceilIndex(2.0f * fluidSize.z));
+                lattices.push_back(block);
+
+                // the falling column is mirrored from the right wall
+                block.begin = glm::ivec3(1.3f * fluidSize.x, 0.4f * fluidSize.y, 0.8f * fluidSize.z);
+                block.end = glm::ivec3(ceilIndex(1.7f * fluidSize.x), ceilIndex(2.4f * fluidSize.y), ceilIndex(1.2f * fluidSize.z));
+                block.origin.x = containerCornerPosition.x + containerSize.x * particleDiameter + particleRadius;
+                block.steps[0] = glm::vec3(-particleDiameter, 0.0f, 0.0f);
+                lattices.push_back(block);
+
+                break;
+            default:
+                lattices.push_back(block);
+        }
+
+        return lattices;
+    }
+
+    std::vector<ParticleLattice> getBoundaryLattices() const {
+        // pairs of opposite walls are interleaved (the third index selects the wall)
+        ParticleLattice walls;
+        walls.origin = containerCornerPosition + particleRadius;
+        walls.margin = 2.0f * neighbourDistance; // neighbours of owned and ghost particles, and the neighbours which complete their psi values
+
+        std::vector<ParticleLattice> lattices;
+
+        // back and front
+        walls.begin = glm::ivec3(0, 0, 0);
+        walls.end = glm::ivec3(containerSize.x + 2, containerSize.y + 2, 2);
+        walls.steps[0] = glm::vec3(particleDiameter, 0.0f, 0.0f);
+        walls.steps[1] = glm::vec3(0.0f, particleDiameter, 0.0f);
+        walls.steps[2] = glm::vec3(0.0f, 0.0f, (containerSize.z + 1) * particleDiameter);
+        lattices.push_back(walls);
+
+        // left and right
+        walls.begin = glm::ivec3(0, 1, 0);
+        walls.end = glm::ivec3(containerSize.y + 2, containerSize.z + 1, 2);
+        walls.steps[0] = glm::vec3(0.0f, particleDiameter, 0.0f);
+        walls.steps[1] = glm::vec3(0.0f, 0.0f, particleDiameter);
+        walls.steps[2] = glm::vec3((containerSize.x + 1) * particleDiameter, 0.0f, 0.0f);
+        lattices.push_back(walls);
+
+        // bottom and top
+        walls.begin = glm::ivec3(1, 1, 0);
+        walls.end = glm::ivec3(containerSize.x + 1, containerSize.z + 1, 2);
+        walls.steps[0] = glm::vec3(particleDiameter, 0.0f, 0.0f);
+        walls.steps[1] = glm::vec3(0.0f, 0.0f, particleDiameter);
+        walls.steps[2] = glm::vec3(0.0f, (containerSize.y + 1) * particleDiameter, 0.0f);
+        lattices.push_back(walls);
+
+        return lattices;
+    }
+
+    bool isInSubdomain(const glm::vec3 &position, float margin = 0.0f) const {
+        return glm::all(glm::greaterThanEqual(position, subdomainMin - margin)) && glm::all(glm::lessThan(position, subdomainMax + margin));
+    }
+
+    template <typename Function>
+    void forEachLatticeRow(const std::vector<ParticleLattice> &lattices, const std::vector<int> &latticeRowBegins, Function function) {
+        // rows of all lattices are distributed over threads
+        #pragma omp for schedule(static)
+        for (int row = 0; row < latticeRowBegins.back(); ++row) {
+            int l = 0;
+            while (row >= latticeRowBegins[l + 1])
+                ++l;
+
+            const ParticleLattice &lattice = lattices[l];
+            int numRowsY = lattice.end.y - lattice.begin.y;
+            int i = lattice.begin.x + (row - latticeRowBegins[l]) / numRowsY;
+            int j = lattice.begin.y + (row - latticeRowBegins[l]) % numRowsY;
+            function(row, lattice, i, j);
+        }
+    }
+
+    bool canReuseBoundary() const {
+        return boundaryCache.valid && boundaryCache.containerSize == containerSize &&
+            boundaryCache.containerCornerPosition == containerCornerPosition && boundaryCache.particleRadius == particleRadius &&
+            boundaryCache.kernelRadius == kernelRadius && boundaryCache.restDensity == restDensity &&
+            boundaryCache.subdomainMin == subdomainMin && boundaryCache.subdomainMax == subdomainMax;
+    }
+
+    void storeBoundary() {
+        boundaryCache.valid = true;
+        boundaryCache.containerSize = containerSize;
+        boundaryCache.containerCornerPosition = containerCornerPosition;
+        boundaryCache.particleRadius = particleRadius;
+        boundaryCache.kernelRadius = kernelRadius;
+        boundaryCache.restDensity = restDensity;
+        boundaryCache.subdomainMin = subdomainMin;
+        boundaryCache.subdomainMax = subdomainMax;
+
+        boundaryCache.positions.assign(positions.begin() + numFluidParticles, positions.end());
+        boundaryCache.psis.assign(psis.begin(), psis.end());
+    }
+
+    void allocateParticleArrays(bool reuseBoundary) {
+        // particles of the scene are counted up front, so each array is allocated once and filled in parallel
+        std::vector<ParticleLattice> lattices = getFluidLattices();
+        int numFluidLattices = static_cast<int>(lattices.size());
+        if (!reuseBoundary) {
+            std::vector<ParticleLattice> boundaryLattices = getBoundaryLattices();
+            lattices.insert(lattices.end(), boundaryLattices.begin(), boundaryLattices.end());
+        }
+
+        std::vector<int> latticeRowBegins(1, 0);
+        for (const ParticleLattice &lattice : lattices)
+            latticeRowBegins.push_back(latticeRowBegins.back() + lattice.getNumRows());
+
+        std::vector<int> rowBegins(latticeRowBegins.back() + 1, 0); // first particle of each row (and the end)
+
+        bool pinThreads = updatePinnedThreads();
+
+        #pragma omp parallel default(shared) num_threads(getNumThreads())
+        {
+            if (pinThreads)
+                Threading::pinThread(threadAffinity, omp_get_thread_num());
+
+            // count particles of rows within the subdomain
+            forEachLatticeRow(lattices, latticeRowBegins, [&](int row, const ParticleLattice &lattice, int i, int j) {
+                int count = 0;
+                for (int k = lattice.begin.z; k < lattice.end.z; ++k)
+                    if (isInSubdomain(lattice.getPosition(i, j, k), lattice.margin))
+                        ++count;
+
+                rowBegins[row + 1] = count;
+            });
+
+            #pragma omp single
+            {
+                for (int row = 0; row < latticeRowBegins.back(); ++row)
+                    rowBegins[row + 1] += rowBegins[row];
+
+                numFluidParticles = rowBegins[latticeRowBegins[numFluidLattices]];
+                numBoundaryParticles = reuseBoundary ? static_cast<int>(boundaryCache.positions.size()) : rowBegins.back() - numFluidParticles;
+                numParticles = numFluidParticles + numBoundaryParticles;
+            }
+
+            // each array is first touched with the static partition of the loops over its particles
+            allocateParticleArray(positions, numParticles);
+
+            forEachLatticeRow(lattices, latticeRowBegins, [&](int row, const ParticleLattice &lattice, int i, int j) {
+                int p = rowBegins[row];
+                for (int k = lattice.begin.z; k < lattice.end.z; ++k) {
+                    glm::vec3 position = lattice.getPosition(i, j, k);
+                    if (isInSubdomain(position, lattice.margin))
+                        positions[p++] = position;
+                }
+            });
+
+            if (reuseBoundary) {
+                #pragma omp for schedule(static)
+                for (int i = 0; i < numBoundaryParticles; ++i)
+                    positions[numFluidParticles + i] = boundaryCache.positions[i];
+            }
+
+            allocateParticleArray(lastPositions, numFluidParticles);
+            copyParticleArray(lastPositions, positions, 0, numFluidParticles);
+            allocateParticleArray(searchPositions, numFluidParticles, glm::vec3(0.0f));
+
+            allocateParticleArray(velocities, numFluidParticles, glm::vec3(0.0f));
+            allocateParticleArray(densities, numFluidParticles, 0.0f);
+            allocateParticleArray(lambdas, numFluidParticles, 0.0f);
+            allocateParticleArray(accumulatedLambdas, numFluidParticles, 0.0f);
+            allocateParticleArray(deltaPositions, numFluidParticles, glm::vec3(0.0f));
+            allocateParticleArray(previousPositions, numFluidParticles, glm::vec3(0.0f));
+            allocateParticleArray(deltaVelocities, numFluidParticles, glm::vec3(0.0f));
+            allocateParticleArray(vorticityDeltaVelocities, numFluidParticles, glm::vec3(0.0f));
+
+            allocateParticleArray(factors, numFluidParticles, 0.0f);
+            allocateParticleArray(kappas, numFluidParticles, 0.0f);
+            allocateParticleArray(pressures, numFluidParticles, 0.0f);
+            allocateParticleArray(densityAdvections, numFluidParticles, 0.0f);
+            allocateParticleArray(pressureAccelerations, numFluidParticles, glm::vec3(0.0f));
+
+            allocateParticleArray(sleeping, numFluidParticles, static_cast<unsigned char>(0));
+            allocateParticleArray(timeLevels, numFluidParticles, static_cast<unsigned char>(0));
+            allocateParticleArray(inactive, numFluidParticles, static_cast<unsigned char>(0));
+            allocateParticleArray(elapsedTimes, numFluidParticles, 0.0f);
+            allocateParticleArray(particleTimeSteps, numFluidParticles, 0.0f);
+            allocateParticleArray(reductionTerms, numFluidParticles, 0.0f);
+
+            // psi values are accumulated from zero, or taken from the boundary of the last reset
+            allocateParticleArray(psis, numBoundaryParticles);
+
+            #pragma omp for schedule(static) nowait
+            for (int i = 0; i < numBoundaryParticles; ++i)
+                psis[i] = reuseBoundary ? boundaryCache.psis[i] : 0.0f;
+        }
+    }
+
+    NumaReport getNumaReport() {
+        NumaReport report;
+        report.available = true;
+        report.numNodes = Threading::getNumNumaNodes();
+
+        #pragma omp parallel default(shared) num_threads(getNumThreads())
+        {
+            int threadIndex = omp_get_thread_num();
+            int numThreads = omp_get_num_threads();
+            int node = Threading::getCurrentNumaNode();
+
+            // partition of the thread in loops over fluid particles
+            int rangeBegin = static_cast<long long>(numFluidParticles) * threadIndex / numThreads;
+            int rangeEnd = static_cast<long long>(numFluidParticles) * (threadIndex + 1) / numThreads;
+            if (loadBalancing == LoadBalancing::NEIGHBOUR_COUNT && static_cast<int>(particleRangeBegins.size()) == numThreads + 1) {
+                rangeBegin = particleRangeBegins[threadIndex];
+                rangeEnd = particleRangeBegins[threadIndex + 1];
+            }
+
+            // arrays read and written in every timestep of PBF
+            std::vector<std::size_t> pagesOnNodes;
+            auto countPages = [&](const auto &array) {
+                return Threading::countPagesOnNodes(array.data() + rangeBegin, (rangeEnd - rangeBegin) * sizeof(array[0]), pagesOnNodes);
+            };
+
+            bool available = node >= 0;
+            available = countPages(positions) && available;
+            available = countPages(lastPositions) && available;
+            available = countPages(velocities) && available;
+            available = countPages(densities) && available;
+            available = countPages(lambdas) && available;
+            available = countPages(deltaPositions) && available;
+            available = countPages(deltaVelocities) && available;
+            available = countPages(particleTimeSteps) && available;
+
+            #pragma omp critical
+            {
+                report.available = report.available && available;
+
+                if (report.pagesOnNodes.size() < pagesOnNodes.size())
+                    report.pagesOnNodes.resize(pagesOnNodes.size());
+
+                for (int i = 0; i < static_cast<int>(pagesOnNodes.size()); ++i) {
+                    report.pagesOnNodes[i] += pagesOnNodes[i];
+                    report.numPages += pagesOnNodes[i];
+                }
+
+                if (node >= 0 && node < static_cast<int>(pagesOnNodes.size()))
+                    report.numLocalPages += pagesOnNodes[node];
+            }
+        }
+
+        return report;
+    }
+
+    HugePageReport getHugePageReport() const {
+        HugePageReport report;
+        report.available = true;
+        report.hugePageSize = Threading::getHugePageSize();
+
+        auto addArray = [&](const char *name, const auto &array) {
+            ArrayPages pages;
+            pages.name = name;
+            pages.numBytes = array.size() * sizeof(array[0]);
+            report.available = Threading::countHugePageBytes(array.data(), pages.numBytes, pages.numHugePageBytes) && report.available;
+            report.arrays.push_back(pages);
+        };
+
+        addArray("positions", positions);
+        addArray("last positions", lastPositions);
+        addArray("velocities", velocities);
+        addArray("densities", densities);
+        addArray("lambdas", lambdas);
+        addArray("delta positions", deltaPositions);
+        addArray("delta velocities", deltaVelocities);
+        addArray("psis", psis);
+        addArray("fluid grid cells", fluidGrid.cellBegins);
+        addArray("fluid grid particles", fluidGrid.particles);
+        addArray("boundary grid cells", boundaryGrid.cellBegins);
+        addArray("boundary grid particles", boundaryGrid.particles);
+        addArray("neighbour lists", neighbourIndices);
+
+        ArrayPages neighbours;
+        neighbours.name = "neighbours";
+        for (const ScratchArena &arena : neighbourArenas)
+            arena.forEachBlock([&](const void *data, std::size_t numBytes) {
+                std::size_t numHugePageBytes = 0;
+                report.available = Threading::countHugePageBytes(data, numBytes, numHugePageBytes) && report.available;
+                neighbours.numBytes += numBytes;
+                neighbours.numHugePageBytes += numHugePageBytes;
+            });
+        report.arrays.push_back(neighbours);
+
+        return report;
+    }
+
+    std::uint64_t hashState() const {
+        // FNV-1a hash of the states of fluid particles, for comparing frames with golden frames in deterministic mode
+        std::uint64_t hash = 14695981039346656037ull;
+        auto hashBytes = [&](const void *data, std::size_t size) {
+            const unsigned char *bytes = static_cast<const unsigned char *>(data);
+            for (std::size_t k = 0; k < size; ++k)
+                hash = (hash ^ bytes[k]) * 1099511628211ull;
+        };
+
+        hashBytes(&numFluidParticles, sizeof(numFluidParticles));
+        hashBytes(positions.data(), numFluidParticles * sizeof(glm::vec3));
+        hashBytes(velocities.data(), numFluidParticles * sizeof(glm::vec3));
+        return hash;
+    }
+
+    template <typename T>
+    void allocateParticleArray(particle_vector<T> &array, int size) {
+        // the old pages are released, and the new ones are not touched by resizing
+        #pragma omp single
+        {
+            particle_vector<T>().swap(array);
+            array.resize(size);
+        }
+    }
+
+    template <typename T>
+    void allocateParticleArray(particle_vector<T> &array, int size, const T &value) {
+        allocateParticleArray(array, size);
+
+        #pragma omp for schedule(static) nowait
+        for (int i = 0; i < size; ++i)
+            array[i] = value;
+    }
+
+    template <typename T>
+    void copyParticleArray(particle_vector<T> &array, const particle_vector<T> &source, int rangeBegin, int rangeEnd) {
+        #pragma omp for schedule(static) nowait
+        for (int i = rangeBegin; i < rangeEnd; ++i)
+            array[i] = source[i];
+    }
+
+    void initializeGrid(const glm::ivec3 &containerSize, const glm::vec3 &containerCornerPosition) {
+        gridCellSize = neighbourDistance;
+        invGridCellSize = 1.0f / gridCellSize;
+
+        // the grid of a subdomain only covers the particles it holds
+        glm::vec3 gridMin = glm::max(containerCornerPosition, subdomainMin - 2.0f * neighbourDistance);
+        glm::vec3 gridMax = glm::min(containerCornerPosition + glm::vec3(containerSize + 2) * particleDiameter, subdomainMax + 2.0f * neighbourDistance);
+        gridCellIndexMin = glm::floor(gridMin * invGridCellSize) - 1.0f;
+        gridCellIndexMax = glm::floor(gridMax * invGridCellSize) + 1.0f;
+        gridSize = gridCellIndexMax - gridCellIndexMin + 1;
+
+        gridSizeYZ = gridSize.y * gridSize.z;
+        gridSizeXYZ = gridSize.x * gridSizeYZ;
+
+        fluidGrid.cellBegins.assign(gridSizeXYZ + 1, 0);
+        fluidGrid.particles.clear();
+
+        boundaryGrid.cellBegins.assign(gridSizeXYZ + 1, 0);
+        boundaryGrid.particles.clear();
+
+        cellQuiescentSteps.assign(gridSizeXYZ, 0);
+        cellTimeLevels.assign(gridSizeXYZ, 0);
+
+        neighbourIndices.assign(numParticles, Span<int>());
+    }
+
+    void updateGrid(const particle_vector<glm::vec3> &positions, int rangeBegin, int rangeEnd, ParticleGrid &grid) {
+        // particles are sorted by x-slabs of cells (a stable counting sort over contiguous chunks of threads),
+        // then by the cells of each slab by one thread, so cells list their particles in index order
+        int numThreads = omp_get_num_threads();
+        int thread = omp_get_thread_num();
+        int numSlabs = gridSize.x;
+        int chunkBegin = rangeBegin + static_cast<long long>(rangeEnd - rangeBegin) * thread / numThreads;
+        int chunkEnd = rangeBegin + static_cast<long long>(rangeEnd - rangeBegin) * (thread + 1) / numThreads;
+
+        #pragma omp single
+        {
+            gridParticleCells.resize(rangeEnd - rangeBegin);
+            gridSortedParticles.resize(rangeEnd - rangeBegin);
+            gridSlabOffsets.assign(numThreads * numSlabs, 0);
+            gridSlabBegins.resize(numSlabs + 1);
+        }
+
+        int *slabOffsets = &gridSlabOffsets[thread * numSlabs];
+
+        for (int i = chunkBegin; i < chunkEnd; ++i) {
+            glm::ivec3 gridCellIndex = glm::floor(positions[i] * invGridCellSize); // absolute index
+            int cell = -1;
+            if (glm::all(glm::greaterThanEqual(gridCellIndex, gridCellIndexMin)) &&
+                glm::all(glm::lessThanEqual(gridCellIndex, gridCellIndexMax))) {
+                gridCellIndex -= gridCellIndexMin; // relative index
+                cell = gridCellIndex.x * gridSizeYZ + gridCellIndex.y * gridSize.z + gridCellIndex.z;
+                ++slabOffsets[gridCellIndex.x];
+            }
+
+            gridParticleCells[i - rangeBegin] = cell;
+        }
+
+        #pragma omp barrier
+        #pragma omp single
+        {
+            // offsets of threads within slabs from counts, in the order of slabs and then threads
+            int offset = 0;
+            for (int slab = 0; slab < numSlabs; ++slab) {
+                gridSlabBegins[slab] = offset;
+                for (int t = 0; t < numThreads; ++t) {
+                    int count = gridSlabOffsets[t * numSlabs + slab];
+                    gridSlabOffsets[t * numSlabs + slab] = offset;
+                    offset += count;
+                }
+            }
+
+            gridSlabBegins[numSlabs] = offset;
+
+            grid.particles.resize(offset);
+            grid.cellBegins[gridSizeXYZ] = offset;
+        }
+
+        for (int i = chunkBegin; i < chunkEnd; ++i) {
+            int cell = gridParticleCells[i - rangeBegin];
+            if (cell >= 0)
+                gridSortedParticles[slabOffsets[cell / gridSizeYZ]++] = i;
+        }
+
+        #pragma omp barrier
+        #pragma omp for schedule(dynamic, 1)
+        for (int slab = 0; slab < numSlabs; ++slab) {
+            int firstCell = slab * gridSizeYZ;
+            int *cellBegins = &grid.cellBegins[firstCell];
+
+            ScratchArena &arena = threadArenas[thread];
+            ScratchArena::Mark mark = arena.getMark();
+            int *cellOffsets = arena.allocate<int>(gridSizeYZ);
+            std::fill(cellOffsets, cellOffsets + gridSizeYZ, 0);
+
+            for (int k = gridSlabBegins[slab]; k < gridSlabBegins[slab + 1]; ++k)
+                ++cellOffsets[gridParticleCells[gridSortedParticles[k] - rangeBegin] - firstCell];
+
+            int offset = gridSlabBegins[slab];
+            for (int cell = 0; cell < gridSizeYZ; ++cell) {
+                cellBegins[cell] = offset;
+                offset += cellOffsets[cell];
+                cellOffsets[cell] = cellBegins[cell];
+            }
+
+            for (int k = gridSlabBegins[slab]; k < gridSlabBegins[slab + 1]; ++k) {
+                int i = gridSortedParticles[k];
+                grid.particles[cellOffsets[gridParticleCells[i - rangeBegin] - firstCell]++] = i;
+            }
+
+            arena.rewind(mark);
+        }
+    }
+
+    void findFluidNeighbours() {
+        updateGrid(positions, 0, numFluidParticles, fluidGrid);
+        findNeighbours(positions, neighbourIndices, 0, numFluidParticles, { &fluidGrid, &boundaryGrid });
+
+        if (loadBalancing == LoadBalancing::NEIGHBOUR_COUNT)
+            updateParticlePartition();
+    }
+
+    int getNumOwnedParticles() const {
+        return numFluidParticles - numGhostParticles;
+    }
+
+    void migrateParticles() {
+        if (haloExchange == nullptr)
+            return;
+
+        #pragma omp single
+        haloExchange->migrate(*this);
+
+        // boundary particles follow the fluid particles, so their indices in the boundary grid changed
+        updateGrid(positions, numFluidParticles, numParticles, boundaryGrid);
+    }
+
+    bool isHaloLost() const {
+        return haloExchange != nullptr && !haloExchange->isConnected();
+    }
+
+    void exchangeHalo(HaloField field) {
+        if (haloExchange == nullptr)
+            return;
+
+        #pragma omp single
+        haloExchange->exchange(*this, field);
+    }
+
+    void resizeFluidParticles(int numKept, int numOwned, int numGhost) {
+        // fluid particles [0, numKept) stay, the others are written by the caller as owned or ghost particles
+        glm::vec3 *boundaryPositions = sharedArena.allocate<glm::vec3>(numBoundaryParticles);
+        std::copy(positions.begin() + numFluidParticles, positions.end(), boundaryPositions);
+
+        numFluidParticles = numOwned + numGhost;
+        numParticles = numFluidParticles + numBoundaryParticles;
+        numGhostParticles = numGhost;
+
+        positions.resize(numParticles);
+        std::copy(boundaryPositions, boundaryPositions + numBoundaryParticles, positions.begin() + numFluidParticles);
+
+        auto resize = [&](auto &array) { array.resize(numFluidParticles); };
+        resize(lastPositions);
+        resize(searchPositions);
+        resize(velocities);
+        resize(densities);
+        resize(lambdas);
+        resize(accumulatedLambdas);
+        resize(deltaPositions);
+        resize(previousPositions);
+        resize(deltaVelocities);
+        resize(vorticityDeltaVelocities);
+        resize(factors);
+        resize(kappas);
+        resize(pressures);
+        resize(densityAdvections);
+        resize(pressureAccelerations);
+        resize(sleeping);
+        resize(timeLevels);
+        resize(inactive);
+        resize(elapsedTimes);
+        resize(particleTimeSteps);
+        resize(reductionTerms);
+
+        // new owned particles are updated in this timestep, ghost particles never
+        for (int i = numKept; i < numFluidParticles; ++i) {
+            sleeping[i] = 0;
+            timeLevels[i] = 0;
+            inactive[i] = i >= numOwned;
+            elapsedTimes[i] = 0.0f;
+            particleTimeSteps[i] = inactive[i] ? 0.0f : timeStep;
+        }
+
+        neighbourIndices.resize(numParticles);
+    }
+
+    void updateParticlePartition() {
+        // split fluid particles into contiguous ranges of equal cost by the prefix sum of costs (neighbours plus one)
+        #pragma omp single
+        {
+            int numThreads = omp_get_num_threads();
+            long long totalCost = 0;
+            for (int i = 0; i < numFluidParticles; ++i)
+                totalCost += inactive[i] ? 1 : neighbourIndices[i].size() + 1;
+
+            particleRangeBegins.assign(numThreads + 1, numFluidParticles);
+            particleRangeBegins[0] = 0;
+
+            long long cost = 0;
+            int thread = 1;
+            for (int i = 0; i < numFluidParticles && thread < numThreads; ++i) {
+                cost += inactive[i] ? 1 : neighbourIndices[i].size() + 1;
+                while (thread < numThreads && cost * numThreads >= totalCost * thread)
+                    particleRangeBegins[thread++] = i + 1;
+            }
+        }
+    }
+
+    template <typename Function>
+    void forEachFluidParticle(Function function, bool wait = true) {
+        // loops over neighbours of fluid particles are distributed by the load balancing scheme
+        int thread = omp_get_thread_num();
+        double startTime = omp_get_wtime();
+
+        if (loadBalancing == LoadBalancing::NEIGHBOUR_COUNT && static_cast<int>(particleRangeBegins.size()) == omp_get_num_threads() + 1) {
+            for (int i = particleRangeBegins[thread]; i < particleRangeBegins[thread + 1]; ++i)
+                function(i);
+        } else if (loadBalancing == LoadBalancing::DYNAMIC) {
+            #pragma omp for schedule(dynamic, dynamicChunkSize) nowait
+            for (int i = 0; i < numFluidParticles; ++i)
+                function(i);
+        } else {
+            #pragma omp for schedule(static) nowait
+            for (int i = 0; i < numFluidParticles; ++i)
+                function(i);
+        }
+
+        double endTime = omp_get_wtime();
+        threadTimes[thread].busy += endTime - startTime;
+
+        // without waiting, the barrier of the following reduction is timed
+        if (wait) {
+            #pragma omp barrier
+            threadTimes[thread].idle += omp_get_wtime() - endTime;
+        }
+    }
+
+    void findNeighbours(const particle_vector<glm::vec3> &positions, particle_vector<Span<int>> &neighbourIndices,
+        int sourceRangeBegin, int sourceRangeEnd, std::initializer_list<const ParticleGrid *> grids) {
+        // lists of the last search are freed, and each thread writes the lists of its particles to its own arena
+        ScratchArena &arena = neighbourArenas[omp_get_thread_num()];
+        arena.reset();
+
+        #pragma omp for schedule(static)
+        for (int i = sourceRangeBegin; i < sourceRangeEnd; ++i) {
+            neighbourIndices[i] = Span<int>();
+            if (i < numFluidParticles && inactive[i]) // inactive particles do not use their neighbours
+                continue;
+
+            const glm::vec3 &pi = positions[i];
+            const glm::ivec3 sourceCellIndex = glm::floor(pi * invGridCellSize); // absolute index
+
+            // cells of the neighbourhood (-1 outside the grid)
+            int targetCellNumbers[27];
+            int maxNumNeighbours = 0;
+            for (int dx = -1, n = 0; dx < 2; ++dx)
+                for (int dy = -1; dy < 2; ++dy)
+                    for (int dz = -1; dz < 2; ++dz, ++n) {
+                        glm::ivec3 targetCellIndex = sourceCellIndex + glm::ivec3(dx, dy, dz);
+                        targetCellNumbers[n] = -1;
+                        if (glm::all(glm::greaterThanEqual(targetCellIndex, gridCellIndexMin)) &&
+                            glm::all(glm::lessThanEqual(targetCellIndex, gridCellIndexMax))) {
+                            targetCellIndex -= gridCellIndexMin;
+                            targetCellNumbers[n] = targetCellIndex.x * gridSizeYZ + targetCellIndex.y * gridSize.z + targetCellIndex.z;
+
+                            for (const ParticleGrid *grid : grids)
+                                maxNumNeighbours += (*grid)[targetCellNumbers[n]].size();
+                        }
+                    }
+
+            // the list takes the space of all candidates, then only the space of the neighbours
+            int *neighbours = arena.reserve<int>(maxNumNeighbours);
+            int numNeighbours = 0;
+            for (int targetCellNumber : targetCellNumbers)
+                if (targetCellNumber >= 0)
+                    for (const ParticleGrid *grid : grids)
+                        for (int j : (*grid)[targetCellNumber]) {
+                            glm::vec3 diff = pi - positions[j];
+                            if (glm::dot(diff, diff) < neighbourDistance2)
+                                neighbours[numNeighbours++] = j;
+                        }
+
+            arena.commit<int>(numNeighbours);
+            neighbourIndices[i] = Span<int>(neighbours, numNeighbours);
+        }
+    }
+
+    void setPsis() {
+        #pragma omp for schedule(static)
+        for (int i = numFluidParticles; i < numParticles; ++i) {
+            const glm::vec3 &pi = positions[i];
+            float &psi = psis[i - numFluidParticles];
+            for (int j : neighbourIndices[i])
+                psi += kernel.WPoly6(pi - positions[j]);
+            psi = restDensity / psi;
+        }
+    }
+
+    void setSPHRestDensity() {
+        // density of an interior particle of the initial cubic lattice (restDensity up to rounding)
+        sphRestDensity = mass * sumLatticeKernel();
+
+        // psi values are set for restDensity
+        boundaryMassScale = sphRestDensity * invRestDensity;
+    }
+
+    void applyGravity() {
+        #pragma omp for schedule(static)
+        for (int i = 0; i < numFluidParticles; ++i) {
+            if (inactive[i])
+                continue;
+
+            velocities[i] += particleTimeSteps[i] * gravity;
+        }
+    }
+
+    void predictPositions() {
+        #pragma omp for schedule(static)
+        for (int i = 0; i < numFluidParticles; ++i) {
+            if (inactive[i])
+                continue;
+
+            glm::vec3 &pi = positions[i];
+            glm::vec3 &vi = velocities[i];
+            pi += particleTimeSteps[i] * vi;
+
+            if (pi.x < positionMin.x) {
+                pi.x = positionMin.x + particleDiameter;
+                vi.x *= -0.5f;
+            } else if (pi.x > positionMax.x) {
+                pi.x = positionMax.x - particleDiameter;
+                vi.x *= -0.5f;
+            }
+
+            if (pi.y < positionMin.y) {
+                pi.y = positionMin.y + particleDiameter;
+                vi.y *= -0.5f;
+            } else if (pi.y > positionMax.y) {
+                pi.y = positionMax.y - particleDiameter;
+                vi.y *= -0.5f;
+            }
+
+            if (pi.z < positionMin.z) {
+                pi.z = positionMin.z + particleDiameter;
+                vi.z *= -0.5f;
+            } else if (pi.z > positionMax.z) {
+                pi.z = positionMax.z - particleDiameter;
+                vi.z *= -0.5f;
+            }
+        }
+    }
+
+    // the residual alone (without storing densities) is measured after the last correction
+    void calculateDensities(bool storeDensities = true) {
+        float threadSumDensityError = 0.0f;
+        float threadMaxDensityError = 0.0f;
+
+        forEachFluidParticle([&](int i) {
+            if (inactive[i])
+                return;
+
+            const glm::vec3 &pi = positions[i];
+            float density = 0.0f;
+
+            for (int j : neighbourIndices[i]) {
+                float m = j < numFluidParticles ? mass : psis[j - numFluidParticles];
+                density += m * kernel.WPoly6(pi - positions[j]);
+            }
+
+            if (storeDensities)
+                densities[i] = density;
+
+            // the constraint of calculateLambdas() is two-sided, so expansion counts as well as compression
+            float densityError = glm::abs(1.0f - density * invRestDensity);
+            addToSum(i, densityError, threadSumDensityError);
+            threadMaxDensityError = glm::max(threadMaxDensityError, densityError);
+        }, false);
+
+        mergeReduction(threadSumDensityError, threadMaxDensityError);
+
+        #pragma omp single
+        {
+            averageDensityError = numActiveParticles > 0 ? reductionSum / numActiveParticles : 0.0f;
+            maxDensityError = reductionMax;
+            clearReduction();
+        }
+    }
+
+    void calculateLambdas() {
+        calculateLambdas(epsilonCFM);
+    }
+
+    void calculateLambdas(float epsilon) {
+        forEachFluidParticle([&](int i) {
+            if (inactive[i]) // inactive particles keep their last lambdas
+                return;
+
+            lambdas[i] = 0.0f;
+            //if (densities[i] < restDensity) // negative Ci
+            //    continue;
+
+            const glm::vec3 &pi = positions[i];
+            float &lambda = lambdas[i];
+
+            glm::vec3 gradConstraint(0.0f); // gradient of Ci with respect to pi (without multiplying invRestDensity)
+
+            for (int j : neighbourIndices[i]) {
+                float m = j < numFluidParticles ? mass : psis[j - numFluidParticles];
+                glm::vec3 grad = m * kernel.gradWSpiky(pi - positions[j]);
+                gradConstraint += grad;
+                lambda += glm::dot(grad, grad);
+            }
+
+            lambda = (1 - densities[i] * invRestDensity) /
+                (invRestDensity2 * (lambda + glm::dot(gradConstraint, gradConstraint)) + epsilon);
+
+            if (warmStartLambdas)
+                accumulatedLambdas[i] += lambda;
+        });
+    }
+
+    void calculateCorrectionsOfPositions(bool applyArtificialPressure = true) {
+        forEachFluidParticle([&](int i) {
+            const glm::vec3 &pi = positions[i];
+            const float &lambdai = lambdas[i];
+            glm::vec3 &deltaPosition = deltaPositions[i];
+
+            deltaPosition = glm::vec3(0.0f);
+
+            if (inactive[i])
+                return;
+
+            for (int j : neighbourIndices[i]) {
+                glm::vec3 r = pi - positions[j];
+                float rNorm2 = glm::dot(r, r);
+                float artificialPressure = applyArtificialPressure ? calculateArtificialPressure(rNorm2) : 0.0f;
+
+                if (j < numFluidParticles)
+                    deltaPosition += (lambdai + lambdas[j] + artificialPressure) * mass * kernel.gradWSpiky(r, rNorm2);
+                else
+                    deltaPosition += (lambdai + artificialPressure) * psis[j - numFluidParticles] * kernel.gradWSpiky(r, rNorm2);
+            }
+
+            deltaPosition *= invRestDensity;
+        });
+    }
+
+    void applyWarmStart() {
+        // corrections of positions scale with the square of the time step
+        float timeStepRatio = warmStartTimeStep > 0.0f ? timeStep / warmStartTimeStep : 0.0f;
+        float factor = warmStartFactor * timeStepRatio * timeStepRatio;
+
+        // every thread has read the time step of the accumulated lambdas
+        #pragma omp barrier
+        #pragma omp master
+        warmStartTimeStep = timeStep;
+
+        #pragma omp for schedule(static)
+        for (int i = 0; i < numFluidParticles; ++i) {
+            if (inactive[i])
+                continue;
+
+            lambdas[i] = factor * accumulatedLambdas[i];
+            accumulatedLambdas[i] = lambdas[i]; // the warm start is part of the correction of this timestep
+        }
+
+        calculateCorrectionsOfPositions(false);
+        correctPositions();
+    }
+
+    void correctPositions() {
+        #pragma omp for schedule(static)
+        for (int i = 0; i < numFluidParticles; ++i)
+            positions[i] += deltaPositions[i];
+    }
+
+    void solveGaussSeidel() {
+        // cells of the same colour are at least two cells apart, so particles in them share no neighbours
+        for (int colour = 0; colour < 8; ++colour) {
+            glm::ivec3 offset((colour >> 2) & 1, (colour >> 1) & 1, colour & 1);
+            glm::ivec3 numColourCells = (gridSize - offset + 1) / 2;
+            int numColourCellsYZ = numColourCells.y * numColourCells.z;
+            int numColourCellsXYZ = numColourCells.x * numColourCellsYZ;
+
+            #pragma omp for schedule(dynamic, 16)
+            for (int c = 0; c < numColourCellsXYZ; ++c) {
+                glm::ivec3 cellIndex = offset + 2 * glm::ivec3(c / numColourCellsYZ, c % numColourCellsYZ / numColourCells.z, c % numColourCells.z);
+                for (int i : fluidGrid[cellIndex.x * gridSizeYZ + cellIndex.y * gridSize.z + cellIndex.z])
+                    if (!inactive[i])
+                        solveParticleGaussSeidel(i);
+            }
+        }
+    }
+
+    void solveParticleGaussSeidel(int i) {
+        glm::vec3 &pi = positions[i];
+        float &density = densities[i];
+        float &lambda = lambdas[i];
+
+        // calculate the density and the lambda with the latest positions
+        density = 0.0f;
+        lambda = 0.0f;
+        glm::vec3 gradConstraint(0.0f);
+
+        for (int j : neighbourIndices[i]) {
+            float m = j < numFluidParticles ? mass : psis[j - numFluidParticles];
+            glm::vec3 r = pi - positions[j];
+            glm::vec3 grad = m * kernel.gradWSpiky(r);
+            density += m * kernel.WPoly6(r);
+            gradConstraint += grad;
+            lambda += glm::dot(grad, grad);
+        }
+
+        lambda = (1 - density * invRestDensity) /
+            (invRestDensity2 * (lambda + glm::dot(gradConstraint, gradConstraint)) + epsilonCFM);
+
+        if (warmStartLambdas)
+            accumulatedLambdas[i] += lambda;
+
+        // correct the position with the latest lambdas of neighbours
+        glm::vec3 deltaPosition(0.0f);
+
+        for (int j : neighbourIndices[i]) {
+            glm::vec3 r = pi - positions[j];
+            float rNorm2 = glm::dot(r, r);
+            float artificialPressure = calculateArtificialPressure(rNorm2);
+
+            if (j < numFluidParticles)
+                deltaPosition += (lambda + lambdas[j] + artificialPressure) * mass * kernel.gradWSpiky(r, rNorm2);
+            else
+                deltaPosition += (lambda + artificialPressure) * psis[j - numFluidParticles] * kernel.gradWSpiky(r, rNorm2);
+        }
+
+        pi += invRestDensity * deltaPosition;
+    }
+
+    void correctPositionsChebyshev(int iter) {
+        #pragma omp single
+        {
+            int delay = glm::max(chebyshevDelay, 1); // the first iteration has no previous positions
+            if (iter < delay)
+                chebyshevOmega = 1.0f;
+            else if (iter == delay)
+                chebyshevOmega = 2.0f / (2.0f - spectralRadius * spectralRadius);
+            else
+                chebyshevOmega = 4.0f / (4.0f - spectralRadius * spectralRadius * chebyshevOmega);
+        }
+
+        #pragma omp for schedule(static)
+        for (int i = 0; i < numFluidParticles; ++i) {
+            if (inactive[i])
+                continue;
+
+            glm::vec3 &pi = positions[i];
+            glm::vec3 &previousPi = previousPositions[i];
+
+            glm::vec3 correctedPi = chebyshevOmega * (pi + deltaPositions[i] - previousPi) + previousPi;
+            previousPi = pi;
+            pi = correctedPi;
+        }
+    }
+
+    void updateSpectralRadius() {
+        // convergence rate of density errors in plain Jacobi iterations
+        float rate = 0.0f;
+        int numRates = 0;
+        for (int iter = 1; iter <= chebyshevDelay && iter < static_cast<int>(densityErrors.size()); ++iter)
+            if (densityErrors[iter - 1] > 1.0e-6f) {
+                rate += densityErrors[iter] / densityErrors[iter - 1];
+                ++numRates;
+            }
+
+        if (numRates > 0)
+            spectralRadius = glm::clamp(0.9f * spectralRadius + 0.1f * rate / numRates, 0.5f, 0.95f);
+    }
+
+    void predictVelocities() {
+        #pragma omp for schedule(static)
+        for (int i = 0; i < numFluidParticles; ++i) {
+            if (inactive[i])
+                continue;
+
+            velocities[i] = 1.0f / particleTimeSteps[i] * (positions[i] - lastPositions[i]);
+            lastPositions[i] = positions[i];
+        }
+    }
+
+    void updateLastPositions() {
+        #pragma omp for schedule(static)
+        for (int i = 0; i < numFluidParticles; ++i)
+            lastPositions[i] = positions[i];
+    }
+
+    void calculateDensitiesAndFactors() {
+        forEachFluidParticle([&](int i) {
+            const glm::vec3 &pi = positions[i];
+            float &density = densities[i];
+
+            density = 0.0f;
+            float sumGrad2 = 0.0f;
+            glm::vec3 sumGrad(0.0f);
+
+            for (int j : neighbourIndices[i]) {
+                glm::vec3 r = pi - positions[j];
+                if (j < numFluidParticles) {
+                    glm::vec3 grad = mass * kernel.gradWSpiky(r);
+                    density += mass * kernel.WPoly6(r);
+                    sumGrad += grad;
+                    sumGrad2 += glm::dot(grad, grad);
+                } else {
+                    float m = boundaryMassScale * psis[j - numFluidParticles];
+                    density += m * kernel.WPoly6(r);
+                    sumGrad += m * kernel.gradWSpiky(r);
+                }
+            }
+
+            float denominator = glm::dot(sumGrad, sumGrad) + sumGrad2;
+            factors[i] = denominator > 1.0e-6f ? 1.0f / denominator : 0.0f;
+        });
+    }
+
+    int solvePressureDFSPH(bool divergenceFree, float errorThreshold) {
+        #pragma omp master
+        densityErrors.clear();
+
+        int iter = 0;
+        for (; iter < maxPressureIteration; ++iter) {
+            // calculate stiffness values from predicted density changes
+            calculateKappasDFSPH(divergenceFree);
+
+            #pragma omp master
+            densityErrors.push_back(averageDensityError);
+
+            if (iter >= minNumIteration && averageDensityError < errorThreshold)
+                break;
+
+            // correct velocities
+            applyKappasDFSPH();
+        }
+
+        return iter;
+    }
+
+    void calculateKappasDFSPH(bool divergenceFree) {
+        const float invTimeStep2 = invTimeStep * invTimeStep;
+        const float invSPHRestDensity = 1.0f / sphRestDensity;
+
+        float threadSumDensityError = 0.0f;
+        float threadMaxDensityError = 0.0f;
+
+        forEachFluidParticle([&](int i) {
+            const glm::vec3 &pi = positions[i];
+            const glm::vec3 &vi = velocities[i];
+
+            // density change in this timestep (boundary particles are at rest)
+            float densityChange = 0.0f;
+
+            for (int j : neighbourIndices[i])
+                if (j < numFluidParticles)
+                    densityChange += mass * glm::dot(vi - velocities[j], kernel.gradWSpiky(pi - positions[j]));
+                else
+                    densityChange += boundaryMassScale * psis[j - numFluidParticles] * glm::dot(vi, kernel.gradWSpiky(pi - positions[j]));
+
+            densityChange *= timeStep;
+
+            // only compression is corrected
+            float densityError = glm::max(divergenceFree ? densityChange : densities[i] + densityChange - sphRestDensity, 0.0f);
+            kappas[i] = densityError * factors[i] * invTimeStep2;
+
+            densityError *= invSPHRestDensity;
+            addToSum(i, densityError, threadSumDensityError);
+            threadMaxDensityError = glm::max(threadMaxDensityError, densityError);
+        }, false);
+
+        mergeReduction(threadSumDensityError, threadMaxDensityError);
+
+        #pragma omp single
+        {
+            averageDensityError = numFluidParticles > 0 ? reductionSum / numFluidParticles : 0.0f;
+            maxDensityError = reductionMax;
+            clearReduction();
+        }
+    }
+
+    void applyKappasDFSPH() {
+        forEachFluidParticle([&](int i) {
+            const glm::vec3 &pi = positions[i];
+            const float &kappai = kappas[i];
+
+            glm::vec3 deltaVelocity(0.0f);
+
+            for (int j : neighbourIndices[i])
+                if (j < numFluidParticles)
+                    deltaVelocity += (kappai + kappas[j]) * mass * kernel.gradWSpiky(pi - positions[j]);
+                else
+                    deltaVelocity += kappai * boundaryMassScale * psis[j - numFluidParticles] * kernel.gradWSpiky(pi - positions[j]);
+
+            velocities[i] -= timeStep * deltaVelocity;
+        });
+    }
+
+    void calculateDensityAdvections() {
+        forEachFluidParticle([&](int i) {
+            const glm::vec3 &pi = positions[i];
+            const glm::vec3 &vi = velocities[i];
+
+            float densityChange = 0.0f;
+
+            for (int j : neighbourIndices[i])
+                if (j < numFluidParticles)
+                    densityChange += mass * glm::dot(vi - velocities[j], kernel.gradWSpiky(pi - positions[j]));
+                else
+                    densityChange += boundaryMassScale * psis[j - numFluidParticles] * glm::dot(vi, kernel.gradWSpiky(pi - positions[j]));
+
+            densityAdvections[i] = densities[i] + timeStep * densityChange;
+            pressures[i] *= 0.5f; // warm start
+        });
+    }
+
+    int solvePressureIISPH() {
+        #pragma omp master
+        densityErrors.clear();
+
+        int iter = 0;
+        for (; iter < maxPressureIteration; ++iter) {
+            // calculate pressure accelerations with current pressures
+            calculatePressureAccelerations();
+
+            // update pressures by relaxed Jacobi iteration
+            updatePressuresIISPH();
+
+            #pragma omp master
+            densityErrors.push_back(averageDensityError);
+
+            // the residual is measured by the update, so the pressures of this iteration are updated as well
+            if (iter >= minNumIteration && averageDensityError < pressureErrorThreshold)
+                return iter + 1;
+        }
+
+        return iter;
+    }
+
+    void calculatePressureAccelerations() {
+        forEachFluidParticle([&](int i) {
+            const glm::vec3 &pi = positions[i];
+            const float pressureTermi = pressures[i] / (densities[i] * densities[i]);
+
+            glm::vec3 acceleration(0.0f);
+
+            for (int j : neighbourIndices[i])
+                if (j < numFluidParticles)
+                    acceleration -= (pressureTermi + pressures[j] / (densities[j] * densities[j])) * mass * kernel.gradWSpiky(pi - positions[j]);
+                else
+                    acceleration -= pressureTermi * boundaryMassScale * psis[j - numFluidParticles] * kernel.gradWSpiky(pi - positions[j]);
+
+            pressureAccelerations[i] = acceleration;
+        });
+    }
+
+    void updatePressuresIISPH() {
+        const float timeStep2 = timeStep * timeStep;
+        const float invSPHRestDensity = 1.0f / sphRestDensity;
+
+        float threadSumDensityError = 0.0f;
+        float threadMaxDensityError = 0.0f;
+
+        forEachFluidParticle([&](int i) {
+            const glm::vec3 &pi = positions[i];
+            const glm::vec3 &ai = pressureAccelerations[i];
+
+            // density change caused by current pressures
+            float densityChange = 0.0f;
+
+            for (int j : neighbourIndices[i])
+                if (j < numFluidParticles)
+                    densityChange += mass * glm::dot(ai - pressureAccelerations[j], kernel.gradWSpiky(pi - positions[j]));
+                else
+                    densityChange += boundaryMassScale * psis[j - numFluidParticles] * glm::dot(ai, kernel.gradWSpiky(pi - positions[j]));
+
+            densityChange *= timeStep2;
+
+            // diagonal element of the pressure Poisson equation
+            float diagonal = factors[i] > 0.0f ? -timeStep2 / (densities[i] * densities[i] * factors[i]) : 0.0f;
+
+            float residual = sphRestDensity - densityAdvections[i] - densityChange;
+            float &pressure = pressures[i];
+            pressure = diagonal < 0.0f ? glm::max(pressure + relaxationIISPH * residual / diagonal, 0.0f) : 0.0f;
+
+            // only compression counts
+            float densityError = glm::max(-residual, 0.0f) * invSPHRestDensity;
+            addToSum(i, densityError, threadSumDensityError);
+            threadMaxDensityError = glm::max(threadMaxDensityError, densityError);
+        }, false);
+
+        mergeReduction(threadSumDensityError, threadMaxDensityError);
+
+        #pragma omp single
+        {
+            averageDensityError = numFluidParticles > 0 ? reductionSum / numFluidParticles : 0.0f;
+            maxDensityError = reductionMax;
+            clearReduction();
+        }
+    }
+
+    void applyPressureAccelerations() {
+        #pragma omp for schedule(static)
+        for (int i = 0; i < numFluidParticles; ++i)
+            velocities[i] += timeStep * pressureAccelerations[i];
+    }
+
+    void applyVelocityCorrections() {
+        if (!fusedPostSolve) {
+            applyVorticityConfinement();
+            exchangeHalo(HaloField::VELOCITIES);
+            applyXSPHViscosity();
+        } else if (exactPostSolveOrdering)
+            applyVorticityConfinementAndXSPHViscosity();
+        else
+            applyVorticityConfinementAndXSPHViscosityFused();
+    }
+
+    void applyVorticityConfinementAndXSPHViscosity() {
+        // same results as applyVorticityConfinement() followed by applyXSPHViscosity(),
+        // but the velocities corrected by vorticity confinement are formed on the fly and updated once
+        forEachFluidParticle([&](int i) {
+            if (inactive[i]) {
+                vorticityDeltaVelocities[i] = glm::vec3(0.0f);
+                return;
+            }
+
+            const glm::vec3 &pi = positions[i];
+            const glm::vec3 &vi = velocities[i];
+
+            float numFluidNeighbours = 0.0f;
+            glm::vec3 eta(0.0f);
+            glm::vec3 omega(0.0f);
+
+            for (int j : neighbourIndices[i])
+                if (j < numFluidParticles) {
+                    eta += positions[j];
+                    omega += glm::cross(velocities[j] - vi, kernel.gradWSpiky(positions[j] - pi));
+                    ++numFluidNeighbours;
+                }
+
+            eta = 0.5f * (eta - numFluidNeighbours * pi);
+            float etaNorm = glm::length(eta);
+            vorticityDeltaVelocities[i] = etaNorm > 1.0e-6f ? particleTimeSteps[i] / frameTime * epsilonVC * glm::cross(eta / etaNorm, omega) : glm::vec3(0.0f);
+        });
+
+        exchangeHalo(HaloField::VORTICITY_DELTA_VELOCITIES);
+
+        forEachFluidParticle([&](int i) {
+            const glm::vec3 &pi = positions[i];
+            const glm::vec3 vi = velocities[i] + vorticityDeltaVelocities[i];
+            glm::vec3 &deltaVelocity = deltaVelocities[i];
+
+            deltaVelocity = glm::vec3(0.0f);
+
+            if (inactive[i])
+                return;
+
+            for (int j : neighbourIndices[i])
+                if (j < numFluidParticles)
+                    deltaVelocity += (velocities[j] + vorticityDeltaVelocities[j] - vi) * kernel.WPoly6(pi - positions[j]) / densities[j];
+
+            deltaVelocity *= particleTimeSteps[i] / frameTime * c * mass;
+        });
+
+        #pragma omp for schedule(static)
+        for (int i = 0; i < numFluidParticles; ++i) {
+            velocities[i] += vorticityDeltaVelocities[i];
+            velocities[i] += deltaVelocities[i];
+        }
+    }
+
+    void applyVorticityConfinementAndXSPHViscosityFused() {
+        // gather curl, eta and XSPH sums in one neighbour traversal (XSPH sees velocities before vorticity confinement)
+        forEachFluidParticle([&](int i) {
+            glm::vec3 &deltaVelocity = deltaVelocities[i];
+
+            deltaVelocity = glm::vec3(0.0f);
+
+            if (inactive[i])
+                return;
+
+            const glm::vec3 &pi = positions[i];
+            const glm::vec3 &vi = velocities[i];
+
+            float numFluidNeighbours = 0.0f;
+            glm::vec3 eta(0.0f);
+            glm::vec3 omega(0.0f);
+            glm::vec3 viscosity(0.0f);
+
+            for (int j : neighbourIndices[i])
+                if (j < numFluidParticles) {
+                    glm::vec3 r = positions[j] - pi;
+                    float rNorm2 = glm::dot(r, r);
+                    glm::vec3 vij = velocities[j] - vi;
+
+                    eta += positions[j];
+                    omega += glm::cross(vij, kernel.gradWSpiky(r, rNorm2));
+                    viscosity += vij * kernel.WPoly6(rNorm2) / densities[j];
+                    ++numFluidNeighbours;
+                }
+
+            eta = 0.5f * (eta - numFluidNeighbours * pi);
+            float etaNorm = glm::length(eta);
+            if (etaNorm > 1.0e-6f)
+                deltaVelocity = epsilonVC * glm::cross(eta / etaNorm, omega);
+
+            deltaVelocity = particleTimeSteps[i] / frameTime * (deltaVelocity + c * mass * viscosity);
+        });
+
+        #pragma omp for schedule(static)
+        for (int i = 0; i < numFluidParticles; ++i)
+            velocities[i] += deltaVelocities[i];
+    }
+
+    void applyVorticityConfinement() {
+        forEachFluidParticle([&](int i) {
+            if (inactive[i]) {
+                deltaVelocities[i] = glm::vec3(0.0f);
+                return;
+            }
+
+            const glm::vec3 &pi = positions[i];
+            const glm::vec3 &vi = velocities[i];
+
+            float numFluidNeighbours = 0.0f;
+            glm::vec3 eta(0.0f);
+            glm::vec3 omega(0.0f);
+
+            for (int j : neighbourIndices[i])
+                if (j < numFluidParticles) {
+                    eta += positions[j];
+                    omega += glm::cross(velocities[j] - vi, kernel.gradWSpiky(positions[j] - pi));
+                    ++numFluidNeighbours;
+                }
+
+            eta = 0.5f * (eta - numFluidNeighbours * pi);
+            float etaNorm = glm::length(eta);
+            deltaVelocities[i] = etaNorm > 1.0e-6f ? particleTimeSteps[i] / frameTime * epsilonVC * glm::cross(eta / etaNorm, omega) : glm::vec3(0.0f);
+        });
+
+        #pragma omp for schedule(static)
+        for (int i = 0; i < numFluidParticles; ++i)
+            velocities[i] += deltaVelocities[i];
+    }
+
+    void applyXSPHViscosity() {
+        forEachFluidParticle([&](int i) {
+            const glm::vec3 &pi = positions[i];
+            const glm::vec3 &vi = velocities[i];
+            glm::vec3 &deltaVelocity = deltaVelocities[i];
+
+            deltaVelocity = glm::vec3(0.0f);
+
+            if (inactive[i])
+                return;
+
+            for (int j : neighbourIndices[i])
+                if (j < numFluidParticles)
+                    //deltaVelocity += (velocities[j] - vi) * kernel.WPoly6(pi - positions[j]);
+                    deltaVelocity += (velocities[j] - vi) * kernel.WPoly6(pi - positions[j]) / densities[j];
+
+            //deltaVelocity *= c;
+            deltaVelocity *= particleTimeSteps[i] / frameTime * c * mass;
+        });
+
+        // correct velocities (by applying XSPH viscosity)
+        #pragma omp for schedule(static)
+        for (int i = 0; i < numFluidParticles; ++i)
+            velocities[i] += deltaVelocities[i];
+    }
+
+    void calculateMaxVelocity() {
+        float threadMaxVelocity2 = 0.0f;
+
+        #pragma omp for schedule(static) nowait
+        for (int i = 0; i < numFluidParticles; ++i)
+            threadMaxVelocity2 = glm::max(threadMaxVelocity2, glm::dot(velocities[i], velocities[i]));
+
+        mergeReduction(0.0f, threadMaxVelocity2);
+
+        #pragma omp single
+        {
+            maxVelocity = glm::sqrt(reductionMax);
+            clearReduction();
+        }
+    }
+
+    void updateSleeping() {
+        // find quiescent cells
+        #pragma omp for schedule(static)
+        for (int c = 0; c < gridSizeXYZ; ++c) {
+            bool isQuiescent = true;
+            for (int i : fluidGrid[c])
+                if (glm::dot(velocities[i], velocities[i]) > sleepVelocityThreshold * sleepVelocityThreshold ||
+                    densities[i] * invRestDensity - 1.0f > sleepDensityErrorThreshold) {
+                    isQuiescent = false;
+                    break;
+                }
+
+            int &quiescentSteps = cellQuiescentSteps[c];
+            quiescentSteps = isQuiescent ? glm::max(quiescentSteps, 0) + 1 : -1;
+        }
+
+        // a cell sleeps if it has been quiescent long enough and no neighbouring cell exceeds thresholds
+        int threadNumSleepingParticles = 0;
+
+        #pragma omp for schedule(static) nowait
+        for (int c = 0; c < gridSizeXYZ; ++c) {
+            if (fluidGrid[c].empty())
+                continue;
+
+            glm::ivec3 cellIndex(c / gridSizeYZ, c % gridSizeYZ / gridSize.z, c % gridSize.z);
+            bool isSleeping = cellQuiescentSteps[c] >= numSleepSteps;
+
+            for (int dx = -1; dx < 2 && isSleeping; ++dx)
+                for (int dy = -1; dy < 2 && isSleeping; ++dy)
+                    for (int dz = -1; dz < 2 && isSleeping; ++dz) {
+                        glm::ivec3 neighbourCellIndex = cellIndex + glm::ivec3(dx, dy, dz);
+                        if (glm::all(glm::greaterThanEqual(neighbourCellIndex, glm::ivec3(0))) &&
+                            glm::all(glm::lessThan(neighbourCellIndex, gridSize)) &&
+                            cellQuiescentSteps[neighbourCellIndex.x * gridSizeYZ + neighbourCellIndex.y * gridSize.z + neighbourCellIndex.z] < 0)
+                            isSleeping = false;
+                    }
+
+            for (int i : fluidGrid[c]) {
+                sleeping[i] = isSleeping;
+                if (isSleeping) {
+                    velocities[i] = glm::vec3(0.0f);
+                    ++threadNumSleepingParticles;
+                }
+            }
+        }
+
+        mergeReduction(0.0f, 0.0f, threadNumSleepingParticles);
+
+        #pragma omp single
+        {
+            numSleepingParticles = reductionCount;
+            clearReduction();
+        }
+    }
+
+    void wakeAll() {
+        // the check is inside single, so all threads agree on encountering it
+        #pragma omp single
+        {
+            if (numSleepingParticles > 0) {
+                std::fill(sleeping.begin(), sleeping.end(), 0);
+                std::fill(cellQuiescentSteps.begin(), cellQuiescentSteps.end(), 0);
+                numSleepingParticles = 0;
+            }
+        }
+    }
+
+    void updateActiveParticles() {
+        bool isPBF = solverType == SolverType::PBF;
+        bool useTimeLevels = multiRate && isPBF;
+
+        // time levels only change when all particles are updated together
+        int numSyncSteps = 1 << maxTimeLevel;
+        if (useTimeLevels && stepIndex % numSyncSteps == 0)
+            updateTimeLevels();
+
+        int threadNumActiveParticles = 0;
+
+        int numOwnedParticles = getNumOwnedParticles();
+
+        #pragma omp for schedule(static) nowait
+        for (int i = 0; i < numFluidParticles; ++i) {
+            bool isGhost = i >= numOwnedParticles; // updated by the owner in another subdomain
+            bool isSleeping = isPBF && sleeping[i];
+            bool isActive = !isGhost && !isSleeping && (!useTimeLevels || stepIndex % (1 << timeLevels[i]) == 0);
+
+            elapsedTimes[i] += timeStep;
+            inactive[i] = !isActive;
+            particleTimeSteps[i] = isActive ? elapsedTimes[i] : 0.0f;
+
+            if (isActive || isSleeping)
+                elapsedTimes[i] = 0.0f;
+
+            if (isActive)
+                ++threadNumActiveParticles;
+        }
+
+        mergeReduction(0.0f, 0.0f, threadNumActiveParticles);
+
+        #pragma omp single
+        {
+            numActiveParticles = reductionCount;
+            numParticleUpdates += numActiveParticles;
+            clearReduction();
+        }
+    }
+
+    void updateTimeLevels() {
+        // the max speed allowed at time level 0
+        float speedLimit = multiRateCFLFactor * particleRadius * invTimeStep;
+
+        // find time levels of grid cells by the max speed of their particles
+        #pragma omp for schedule(static)
+        for (int c = 0; c < gridSizeXYZ; ++c) {
+            float maxSpeed2 = 0.0f;
+            for (int i : fluidGrid[c])
+                maxSpeed2 = glm::max(maxSpeed2, glm::dot(velocities[i], velocities[i]));
+
+            float maxSpeed = glm::sqrt(maxSpeed2);
+            int level = 0;
+            while (level < maxTimeLevel && maxSpeed * (2 << level) <= speedLimit)
+                ++level;
+
+            cellTimeLevels[c] = level;
+        }
+
+        // a particle is at most one level coarser than neighbouring cells, so interfaces between levels are gradual
+        #pragma omp for schedule(static)
+        for (int c = 0; c < gridSizeXYZ; ++c) {
+            if (fluidGrid[c].empty())
+                continue;
+
+            glm::ivec3 cellIndex(c / gridSizeYZ, c % gridSizeYZ / gridSize.z, c % gridSize.z);
+            int level = cellTimeLevels[c];
+
+            for (int dx = -1; dx < 2; ++dx)
+                for (int dy = -1; dy < 2; ++dy)
+                    for (int dz = -1; dz < 2; ++dz) {
+                        glm::ivec3 neighbourCellIndex = cellIndex + glm::ivec3(dx, dy, dz);
+                        if (glm::all(glm::greaterThanEqual(neighbourCellIndex, glm::ivec3(0))) &&
+                            glm::all(glm::lessThan(neighbourCellIndex, gridSize)))
+                            level = glm::min(level, cellTimeLevels[neighbourCellIndex.x * gridSizeYZ + neighbourCellIndex.y * gridSize.z + neighbourCellIndex.z] + 1);
+                    }
+
+            for (int i : fluidGrid[c])
+                timeLevels[i] = static_cast<unsigned char>(level);
+        }
+    }
+
+    void initializeClusterLevels() {
+        clusterLevels.clear();
+        clusterLevels.resize(numCoarseLevels);
+
+        for (int l = 0; l < numCoarseLevels; ++l) {
+            ClusterLevel &level = clusterLevels[l];
+            level.clusterSize = 1 << l;
+            level.kernelScale = 1.0f / (2 << l); // keeps the ratio of the kernel radius to the spacing of clusters
+            level.searchRange = static_cast<int>(glm::ceil(kernelRadius / (level.kernelScale * level.clusterSize * gridCellSize)));
+            level.gridSize = (gridSize + level.clusterSize - 1) / level.clusterSize;
+            level.gridSizeYZ = level.gridSize.y * level.gridSize.z;
+            level.gridSizeXYZ = level.gridSize.x * level.gridSizeYZ;
+
+            level.positions.resize(level.gridSizeXYZ);
+            level.masses.resize(level.gridSizeXYZ);
+            level.densities.resize(level.gridSizeXYZ);
+            level.lambdas.resize(level.gridSizeXYZ);
+            level.deltaPositions.resize(level.gridSizeXYZ);
+            level.sumDeltaPositions.resize(level.gridSizeXYZ);
+
+            // boundary clusters are fixed
+            level.boundaryPositions.assign(level.gridSizeXYZ, glm::vec3(0.0f));
+            level.boundaryMasses.assign(level.gridSizeXYZ, 0.0f);
+
+            for (int c = 0; c < gridSizeXYZ; ++c) {
+                glm::ivec3 cellIndex(c / gridSizeYZ, c % gridSizeYZ / gridSize.z, c % gridSize.z);
+                glm::ivec3 clusterIndex = cellIndex / level.clusterSize;
+                int clusterNumber = clusterIndex.x * level.gridSizeYZ + clusterIndex.y * level.gridSize.z + clusterIndex.z;
+
+                for (int i : boundaryGrid[c]) {
+                    float psi = psis[i - numFluidParticles];
+                    level.boundaryPositions[clusterNumber] += psi * positions[i];
+                    level.boundaryMasses[clusterNumber] += psi;
+                }
+            }
+
+            for (int c = 0; c < level.gridSizeXYZ; ++c)
+                if (level.boundaryMasses[c] > 0.0f)
+                    level.boundaryPositions[c] /= level.boundaryMasses[c];
+        }
+    }
+
+    void solveClusterLevels() {
+        #pragma omp single
+        {
+            if (static_cast<int>(clusterLevels.size()) != numCoarseLevels)
+                initializeClusterLevels();
+        }
+
+        for (int l = numCoarseLevels - 1; l >= 0; --l) {
+            ClusterLevel &level = clusterLevels[l];
+
+            // restrict fine particles to clusters
+            buildClusters(level);
+
+            for (int iter = 0; iter < numCoarseIteration; ++iter)
+                solveClusterLevel(level);
+
+            // prolongate corrections to fine particles
+            applyClusterCorrections(level);
+        }
+    }
+
+    void buildClusters(ClusterLevel &level) {
+        #pragma omp for schedule(static)
+        for (int c = 0; c < level.gridSizeXYZ; ++c) {
+            glm::ivec3 cellIndexMin = level.clusterSize * glm::ivec3(c / level.gridSizeYZ, c % level.gridSizeYZ / level.gridSize.z, c % level.gridSize.z);
+            glm::ivec3 cellIndexMax = glm::min(cellIndexMin + level.clusterSize, gridSize);
+
+            glm::vec3 position(0.0f);
+            int numClusterParticles = 0;
+
+            for (int x = cellIndexMin.x; x < cellIndexMax.x; ++x)
+                for (int y = cellIndexMin.y; y < cellIndexMax.y; ++y)
+                    for (int z = cellIndexMin.z; z < cellIndexMax.z; ++z)
+                        for (int i : fluidGrid[x * gridSizeYZ + y * gridSize.z + z]) {
+                            position += positions[i];
+                            ++numClusterParticles;
+                        }
+
+            level.positions[c] = numClusterParticles > 0 ? position / static_cast<float>(numClusterParticles) : position;
+            level.masses[c] = numClusterParticles * mass;
+            level.sumDeltaPositions[c] = glm::vec3(0.0f);
+        }
+    }
+
+    template <typename Function>
+    void forEachNeighbourCluster(const ClusterLevel &level, int c, Function function) {
+        glm::ivec3 clusterIndex(c / level.gridSizeYZ, c % level.gridSizeYZ / level.gridSize.z, c % level.gridSize.z);
+
+        const int r = level.searchRange;
+
+        for (int dx = -r; dx <= r; ++dx)
+            for (int dy = -r; dy <= r; ++dy)
+                for (int dz = -r; dz <= r; ++dz) {
+                    glm::ivec3 neighbourIndex = clusterIndex + glm::ivec3(dx, dy, dz);
+                    if (glm::all(glm::greaterThanEqual(neighbourIndex, glm::ivec3(0))) &&
+                        glm::all(glm::lessThan(neighbourIndex, level.gridSize)))
+                        function(neighbourIndex.x * level.gridSizeYZ + neighbourIndex.y * level.gridSize.z + neighbourIndex.z);
+                }
+    }
+
+    void solveClusterLevel(ClusterLevel &level) {
+        // kernels of this level are scaled from fine kernels: W_H(r) = s^3 W_h(s r), grad W_H(r) = s^4 grad W_h(s r)
+        const float s = level.kernelScale;
+        const float factorW = s * s * s;
+        const float factorGradW = factorW * s;
+        const float epsilon = epsilonCFM * s * s; // keeps the relative regularization of fine constraints
+
+        // calculate densities and lambdas
+        #pragma omp for schedule(static)
+        for (int c = 0; c < level.gridSizeXYZ; ++c) {
+            if (level.masses[c] == 0.0f)
+                continue;
+
+            const glm::vec3 &pc = level.positions[c];
+            float density = 0.0f;
+            float sumGrad2 = 0.0f;
+            glm::vec3 gradConstraint(0.0f);
+
+            forEachNeighbourCluster(level, c, [&](int d) {
+                if (level.masses[d] > 0.0f) {
+                    glm::vec3 r = s * (pc - level.positions[d]);
+                    glm::vec3 grad = level.masses[d] * factorGradW * kernel.gradWSpiky(r);
+                    density += level.masses[d] * factorW * kernel.WPoly6(r);
+                    gradConstraint += grad;
+                    sumGrad2 += glm::dot(grad, grad);
+                }
+
+                if (level.boundaryMasses[d] > 0.0f) {
+                    glm::vec3 r = s * (pc - level.boundaryPositions[d]);
+                    density += level.boundaryMasses[d] * factorW * kernel.WPoly6(r);
+                    gradConstraint += level.boundaryMasses[d] * factorGradW * kernel.gradWSpiky(r);
+                }
+            });
+
+            // only compression is corrected on coarse levels (clusters near the free surface are always underdense)
+            level.densities[c] = density;
+            level.lambdas[c] = glm::min(1 - density * invRestDensity, 0.0f) /
+                (invRestDensity2 * (sumGrad2 + glm::dot(gradConstraint, gradConstraint)) + epsilon);
+        }
+
+        // calculate corrections of positions
+        #pragma omp for schedule(static)
+        for (int c = 0; c < level.gridSizeXYZ; ++c) {
+            if (level.masses[c] == 0.0f)
+                continue;
+
+            const glm::vec3 &pc = level.positions[c];
+            const float &lambdac = level.lambdas[c];
+            glm::vec3 deltaPosition(0.0f);
+
+            forEachNeighbourCluster(level, c, [&](int d) {
+                if (level.masses[d] > 0.0f && d != c)
+                    deltaPosition += (lambdac + level.lambdas[d]) * level.masses[d] * factorGradW * kernel.gradWSpiky(s * (pc - level.positions[d]));
+
+                if (level.boundaryMasses[d] > 0.0f)
+                    deltaPosition += lambdac * level.boundaryMasses[d] * factorGradW * kernel.gradWSpiky(s * (pc - level.boundaryPositions[d]));
+            });
+
+            level.deltaPositions[c] = invRestDensity * deltaPosition;
+        }
+
+        // correct positions of clusters
+        #pragma omp for schedule(static)
+        for (int c = 0; c < level.gridSizeXYZ; ++c) {
+            level.positions[c] += level.deltaPositions[c];
+            level.sumDeltaPositions[c] += level.deltaPositions[c];
+        }
+    }
+
+    void applyClusterCorrections(const ClusterLevel &level) {
+        #pragma omp for schedule(static)
+        for (int c = 0; c < gridSizeXYZ; ++c) {
+            glm::ivec3 clusterIndex = glm::ivec3(c / gridSizeYZ, c % gridSizeYZ / gridSize.z, c % gridSize.z) / level.clusterSize;
+            const glm::vec3 &deltaPosition = level.sumDeltaPositions[clusterIndex.x * level.gridSizeYZ + clusterIndex.y * level.gridSize.z + clusterIndex.z];
+
+            for (int i : fluidGrid[c])
+                if (!inactive[i])
+                    positions[i] += deltaPosition;
         }
     }
 };
@@ -0,0 +1,598 @@
+#include "Threading.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+
+#if defined(_WIN32)
+#define NOMINMAX
+#include <windows.h>
+#include <psapi.h>
+#include <process.h>
+#elif defined(__linux__)
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#else
+#include <unistd.h>
+#endif
+
+static const std::size_t cacheLineSize = 64;
+static std::atomic<HugePages> hugePages(HugePages::TRANSPARENT);
+static thread_local long long numAllocations = 0;
+
+// huge pages are physically contiguous, so arrays starting at the same offset in them compete for the same cache sets;
+// successive arrays start at staggered offsets instead
+static const std::size_t numCacheColours = 16;
+static const std::size_t cacheColourStride = 4096 + cacheLineSize;
+static std::atomic<unsigned> nextCacheColour(0);
+
+#if defined(_DEBUG)
+// heap allocations are counted, so debug builds can check that steps do not allocate
+void *operator new(std::size_t size) {
+    ++numAllocations;
+    if (void *data = std::malloc(size > 0 ? size : 1))
+        return data;
+
+    throw std::bad_alloc();
+}
+
+void operator delete(void *data) noexcept {
+    std::free(data);
+}
+
+void operator delete(void *data, std::size_t) noexcept {
+    std::free(data);
+}
+#endif
+
+static std::size_t roundUp(std::size_t size, std::size_t multiple) {
+    return (size + multiple - 1) / multiple * multiple;
+}
+
+static std::size_t getCacheColourOffset() {
+    return nextCacheColour++ % numCacheColours * cacheColourStride;
+}
+
+#if defined(_WIN32)
+// large pages need the privilege to lock memory, which is enabled once if the user holds it
+static bool enableLockMemoryPrivilege() {
+    static const bool enabled = [] {
+        HANDLE token;
+        if (!OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &token))
+            return false;
+
+        TOKEN_PRIVILEGES privileges = {};
+        privileges.PrivilegeCount = 1;
+        privileges.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+        bool succeeded = LookupPrivilegeValue(nullptr, SE_LOCK_MEMORY_NAME, &privileges.Privileges[0].Luid) &&
+            AdjustTokenPrivileges(token, FALSE, &privileges, 0, nullptr, nullptr) && GetLastError() == ERROR_SUCCESS;
+
+        CloseHandle(token);
+        return succeeded;
+    }();
+
+    return enabled;
+}
+#endif
+
+// sets an environment variable (removes it if value is null)
+static bool setEnvironmentVariable(const char *name, const char *value) {
+#if defined(_WIN32)
+    return _putenv_s(name, value != nullptr ? value : "") == 0;
+#else
+    return value != nullptr ? setenv(name, value, 1) == 0 : unsetenv(name) == 0;
+#endif
+}
+
+#if defined(_WIN32)
+// quotes an argument of a command line as parsed by the C runtime (backslashes are only special before quotes)
+static std::string quoteArgument(const std::string &argument) {
+    if (!argument.empty() && argument.find_first_of(" \t\"") == std::string::npos)
+        return argument;
+
+    std::string quoted = "\"";
+    int numBackslashes = 0;
+    for (char c : argument) {
+        if (c == '\\') {
+            ++numBackslashes;
+            continue;
+        }
+
+        quoted.append(c == '"' ? 2 * numBackslashes + 1 : numBackslashes, '\\');
+        quoted += c;
+        numBackslashes = 0;
+    }
+
+    quoted.append(2 * numBackslashes, '\\');
+    return quoted + "\"";
+}
+#endif
+
+#if defined(__linux__)
+// parses a list of processors such as "0-3,8-11"
+static std::vector<int> parseProcessorList(const std::string &list) {
+    std::vector<int> processors;
+    std::stringstream stream(list);
+    std::string range;
+    while (std::getline(stream, range, ',')) {
+        if (range.empty())
+            continue;
+
+        size_t dash = range.find('-');
+        int first = std::stoi(range.substr(0, dash));
+        int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+        for (int processor = first; processor <= last; ++processor)
+            processors.push_back(processor);
+    }
+
+    return processors;
+}
+#endif
+
+std::vector<std::vector<int>> Threading::findNodeProcessors() {
+    std::vector<std::vector<int>> nodeProcessors;
+
+#if defined(_WIN32)
+    // only processors of the first processor group (at most 64) are used
+    DWORD_PTR processMask, systemMask;
+    if (!GetProcessAffinityMask(GetCurrentProcess(), &processMask, &systemMask))
+        processMask = 0;
+
+    ULONG highestNode = 0;
+    if (GetNumaHighestNodeNumber(&highestNode))
+        for (ULONG node = 0; node <= highestNode; ++node) {
+            ULONGLONG nodeMask = 0;
+            GetNumaNodeProcessorMask(static_cast<UCHAR>(node), &nodeMask);
+
+            nodeProcessors.emplace_back();
+            for (int processor = 0; processor < 64; ++processor)
+                if ((nodeMask & processMask) >> processor & 1)
+                    nodeProcessors.back().push_back(processor);
+        }
+
+    if (nodeProcessors.empty()) {
+        nodeProcessors.emplace_back();
+        for (int processor = 0; processor < 64; ++processor)
+            if (static_cast<ULONGLONG>(processMask) >> processor & 1)
+                nodeProcessors.back().push_back(processor);
+    }
+#elif defined(__linux__)
+    cpu_set_t processSet;
+    CPU_ZERO(&processSet);
+    sched_getaffinity(0, sizeof(cpu_set_t), &processSet);
+
+    // node ids may have gaps, so nodes without processors of the process are kept as empty lists
+    for (int node = 0; node < 256; ++node) {
+        std::ifstream file("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+        if (!file)
+            continue;
+
+        std::string list;
+        std::getline(file, list);
+
+        nodeProcessors.resize(node + 1);
+        for (int processor : parseProcessorList(list))
+            if (processor < CPU_SETSIZE && CPU_ISSET(processor, &processSet))
+                nodeProcessors[node].push_back(processor);
+    }
+
+    if (nodeProcessors.empty()) {
+        nodeProcessors.emplace_back();
+        for (int processor = 0; processor < CPU_SETSIZE; ++processor)
+            if (CPU_ISSET(processor, &processSet))
+                nodeProcessors.back().push_back(processor);
+    }
+#else
+    nodeProcessors.emplace_back();
+    for (int processor = 0; processor < static_cast<int>(std::thread::hardware_concurrency()); ++processor)
+        nodeProcessors.back().push_back(processor);
+#endif
+
+    return nodeProcessors;
+}
+
+const std::vector<std::vector<int>> &Threading::getNodeProcessors() {
+    // found once, before any thread is pinned
+    static const std::vector<std::vector<int>> nodeProcessors = findNodeProcessors();
+    return nodeProcessors;
+}
+
+bool Threading::setThreadProcessors(const std::vector<int> &processors) {
+    if (processors.empty())
+        return false;
+
+#if defined(_WIN32)
+    DWORD_PTR mask = 0;
+    for (int processor : processors)
+        mask |= static_cast<DWORD_PTR>(1) << processor;
+
+    return SetThreadAffinityMask(GetCurrentThread(), mask) != 0;
+#elif defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int processor : processors)
+        CPU_SET(processor, &set);
+
+    return sched_setaffinity(0, sizeof(cpu_set_t), &set) == 0;
+#else
+    return false;
+#endif
+}
+
+int Threading::getNumNumaNodes() {
+    return getNodeProcessors().size();
+}
+
+bool Threading::pinThread(ThreadAffinity affinity, int threadIndex) {
+    const std::vector<std::vector<int>> &nodeProcessors = getNodeProcessors();
+
+    // order processors, so thread i is pinned to the i-th processor
+    std::vector<int> processors;
+    switch (affinity) {
+        case (ThreadAffinity::COMPACT):
+            for (const std::vector<int> &node : nodeProcessors)
+                processors.insert(processors.end(), node.begin(), node.end());
+
+            break;
+        case (ThreadAffinity::SCATTER):
+            // the i-th processors of all nodes before the (i + 1)-th ones
+            for (size_t i = 0;; ++i) {
+                size_t numProcessors = processors.size();
+                for (const std::vector<int> &node : nodeProcessors)
+                    if (i < node.size())
+                        processors.push_back(node[i]);
+
+                if (processors.size() == numProcessors)
+                    break;
+            }
+
+            break;
+        default:
+            // unpin the thread
+            for (const std::vector<int> &node : nodeProcessors)
+                processors.insert(processors.end(), node.begin(), node.end());
+
+            return setThreadProcessors(processors);
+    }
+
+    if (processors.empty())
+        return false;
+
+    return setThreadProcessors({ processors[threadIndex % processors.size()] });
+}
+
+int Threading::getCurrentNumaNode() {
+#if defined(_WIN32)
+    PROCESSOR_NUMBER processorNumber;
+    GetCurrentProcessorNumberEx(&processorNumber);
+
+    USHORT node;
+    return GetNumaProcessorNodeEx(&processorNumber, &node) ? node : -1;
+#elif defined(__linux__) && defined(SYS_getcpu)
+    unsigned int processor, node;
+    return syscall(SYS_getcpu, &processor, &node, nullptr) == 0 ? static_cast<int>(node) : -1;
+#else
+    return -1;
+#endif
+}
+
+bool Threading::countPagesOnNodes(const void *data, std::size_t size, std::vector<std::size_t> &pageCounts) {
+    if (size == 0)
+        return true;
+
+#if defined(_WIN32)
+    SYSTEM_INFO systemInfo;
+    GetSystemInfo(&systemInfo);
+    std::uintptr_t pageSize = systemInfo.dwPageSize;
+#elif defined(__linux__) && defined(SYS_move_pages)
+    std::uintptr_t pageSize = sysconf(_SC_PAGESIZE);
+#else
+    std::uintptr_t pageSize = 0;
+#endif
+
+    if (pageSize == 0)
+        return false;
+
+    std::uintptr_t begin = reinterpret_cast<std::uintptr_t>(data) & ~(pageSize - 1);
+    std::uintptr_t end = reinterpret_cast<std::uintptr_t>(data) + size;
+
+    std::vector<int> nodes; // node of each page (negative if the page is not resident)
+
+#if defined(_WIN32)
+    std::vector<PSAPI_WORKING_SET_EX_INFORMATION> pages;
+    for (std::uintptr_t page = begin; page < end; page += pageSize) {
+        pages.emplace_back();
+        pages.back().VirtualAddress = reinterpret_cast<void *>(page);
+    }
+
+    if (!QueryWorkingSetEx(GetCurrentProcess(), pages.data(), static_cast<DWORD>(pages.size() * sizeof(PSAPI_WORKING_SET_EX_INFORMATION))))
+        return false;
+
+    for (const PSAPI_WORKING_SET_EX_INFORMATION &page : pages)
+        nodes.push_back(page.VirtualAttributes.Valid ? static_cast<int>(page.VirtualAttributes.Node) : -1);
+#elif defined(__linux__) && defined(SYS_move_pages)
+    std::vector<void *> pages;
+    for (std::uintptr_t page = begin; page < end; page += pageSize)
+        pages.push_back(reinterpret_cast<void *>(page));
+
+    // move_pages without target nodes only queries the nodes of the pages
+    nodes.resize(pages.size());
+    if (syscall(SYS_move_pages, 0, pages.size(), pages.data(), nullptr, nodes.data(), 0) != 0)
+        return false;
+#endif
+
+    for (int node : nodes)
+        if (node >= 0) {
+            if (node >= static_cast<int>(pageCounts.size()))
+                pageCounts.resize(node + 1);
+            ++pageCounts[node];
+        }
+
+    return true;
+}
+
+WaitPolicy Threading::getWaitPolicy() {
+    const char *value = std::getenv("OMP_WAIT_POLICY");
+    if (value == nullptr)
+        return WaitPolicy::DEFAULT;
+
+    std::string policy(value);
+    if (policy == "ACTIVE" || policy == "active")
+        return WaitPolicy::SPIN;
+    if (policy == "PASSIVE" || policy == "passive")
+        return WaitPolicy::YIELD;
+
+    return WaitPolicy::DEFAULT;
+}
+
+bool Threading::setWaitPolicy(WaitPolicy policy) {
+    // OMP_WAIT_POLICY is standard, the others tune how long threads of GCC and LLVM/Intel runtimes spin before they sleep
+    const char *waitPolicy = nullptr;
+    const char *spinCount = nullptr;
+    const char *blockTime = nullptr;
+    switch (policy) {
+        case (WaitPolicy::SPIN):
+            waitPolicy = "ACTIVE";
+            spinCount = "infinite";
+            blockTime = "infinite";
+            break;
+        case (WaitPolicy::YIELD):
+            waitPolicy = "PASSIVE";
+            spinCount = "0";
+            blockTime = "0";
+            break;
+        default:
+            break;
+    }
+
+    return setEnvironmentVariable("OMP_WAIT_POLICY", waitPolicy) && setEnvironmentVariable("GOMP_SPINCOUNT", spinCount) &&
+        setEnvironmentVariable("KMP_BLOCKTIME", blockTime);
+}
+
+bool Threading::isWaitPolicySupported() {
+#if defined(_WIN32)
+    // vcomp of MSVC /openmp reads none of the variables, unlike the LLVM runtime of /openmp:llvm
+    return GetModuleHandleA("vcomp140.dll") == nullptr && GetModuleHandleA("vcomp140d.dll") == nullptr;
+#else
+    return true;
+#endif
+}
+
+bool Threading::restartProcess(char *argv[]) {
+#if defined(_WIN32)
+    char path[MAX_PATH];
+    DWORD length = GetModuleFileNameA(nullptr, path, MAX_PATH);
+    if (length == 0 || length == MAX_PATH)
+        return false;
+
+    // _spawnv() joins the arguments with spaces, so arguments with spaces are quoted
+    std::vector<std::string> arguments;
+    for (char **argument = argv; *argument != nullptr; ++argument)
+        arguments.push_back(quoteArgument(*argument));
+
+    std::vector<const char *> quotedArgv;
+    for (const std::string &argument : arguments)
+        quotedArgv.push_back(argument.c_str());
+    quotedArgv.push_back(nullptr);
+
+    // this process waits for the new one, so the console waits for both, and exits with its status
+    intptr_t status = _spawnv(_P_WAIT, path, quotedArgv.data());
+    if (status == -1)
+        return false;
+
+    std::exit(static_cast<int>(status));
+#elif defined(__linux__)
+    execv("/proc/self/exe", argv);
+    return false;
+#else
+    execvp(argv[0], argv);
+    return false;
+#endif
+}
+
+void Threading::setHugePages(HugePages pages) {
+    hugePages = pages;
+}
+
+HugePages Threading::getHugePages() {
+    return hugePages;
+}
+
+std::size_t Threading::getHugePageSize() {
+    static const std::size_t hugePageSize = [] {
+        std::size_t size = 0;
+#if defined(_WIN32)
+        size = GetLargePageMinimum();
+#elif defined(__linux__)
+        std::ifstream file("/sys/kernel/mm/transparent_hugepage/hpage_pmd_size");
+        if (!(file >> size))
+            size = 0;
+#endif
+        return size > 0 ? size : static_cast<std::size_t>(2 * 1024 * 1024);
+    }();
+
+    return hugePageSize;
+}
+
+void *Threading::allocatePages(std::size_t size) {
+    ++numAllocations;
+    std::size_t hugePageSize = getHugePageSize();
+
+#if defined(_WIN32)
+    if (size >= hugePageSize) {
+        // large pages are committed at once, so they are placed on the NUMA node of the allocating thread
+        if (hugePages == HugePages::EXPLICIT && enableLockMemoryPrivilege()) {
+            std::size_t offset = getCacheColourOffset();
+            if (void *data = VirtualAlloc(nullptr, roundUp(size + offset, hugePageSize), MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE))
+                return static_cast<char *>(data) + offset;
+        }
+
+        if (void *data = VirtualAlloc(nullptr, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE))
+            return data;
+
+        throw std::bad_alloc();
+    }
+
+    if (void *data = _aligned_malloc(size > 0 ? size : 1, cacheLineSize))
+        return data;
+#elif defined(__linux__)
+    if (size >= hugePageSize) {
+        std::size_t offset = getCacheColourOffset();
+        std::size_t mappedSize = roundUp(size + offset, hugePageSize);
+
+#if defined(MAP_HUGETLB)
+        if (hugePages == HugePages::EXPLICIT) {
+            void *data = mmap(nullptr, mappedSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+            if (data != MAP_FAILED)
+                return static_cast<char *>(data) + offset;
+        }
+#endif
+
+        // transparent huge pages need aligned ranges, so the ends of a larger mapping are unmapped
+        void *mapping = mmap(nullptr, mappedSize + hugePageSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mapping == MAP_FAILED)
+            throw std::bad_alloc();
+
+        char *begin = static_cast<char *>(mapping);
+        char *data = begin + (hugePageSize - reinterpret_cast<std::uintptr_t>(begin) % hugePageSize) % hugePageSize;
+        if (data > begin)
+            munmap(begin, data - begin);
+        if (data + mappedSize < begin + mappedSize + hugePageSize)
+            munmap(data + mappedSize, begin + hugePageSize - data);
+
+        // fails harmlessly if the kernel has no transparent huge pages
+#if defined(MADV_HUGEPAGE)
+        madvise(data, mappedSize, hugePages == HugePages::NONE ? MADV_NOHUGEPAGE : MADV_HUGEPAGE);
+#endif
+
+        return data + offset;
+    }
+
+    void *data = nullptr;
+    if (posix_memalign(&data, cacheLineSize, size) == 0)
+        return data;
+#else
+    void *data = nullptr;
+    if (posix_memalign(&data, cacheLineSize, size) == 0)
+        return data;
+#endif
+
+    throw std::bad_alloc();
+}
+
+void Threading::freePages(void *data, std::size_t size) {
+    if (data == nullptr)
+        return;
+
+#if defined(_WIN32)
+    // the allocation may start after the beginning of its pages
+    if (size >= getHugePageSize()) {
+        MEMORY_BASIC_INFORMATION info;
+        if (VirtualQuery(data, &info, sizeof(info)) != 0)
+            VirtualFree(info.AllocationBase, 0, MEM_RELEASE);
+    } else
+        _aligned_free(data);
+#elif defined(__linux__)
+    // the allocation starts less than a huge page after the beginning of its aligned mapping
+    std::size_t hugePageSize = getHugePageSize();
+    if (size >= hugePageSize) {
+        char *mapping = static_cast<char *>(data) - reinterpret_cast<std::uintptr_t>(data) % hugePageSize;
+        munmap(mapping, roundUp(size + (static_cast<char *>(data) - mapping), hugePageSize));
+    } else
+        std::free(data);
+#else
+    std::free(data);
+#endif
+}
+
+bool Threading::countHugePageBytes(const void *data, std::size_t size, std::size_t &numBytes) {
+    numBytes = 0;
+    if (size == 0)
+        return true;
+
+    std::uintptr_t begin = reinterpret_cast<std::uintptr_t>(data);
+    std::uintptr_t end = begin + size;
+
+#if defined(_WIN32)
+    SYSTEM_INFO systemInfo;
+    GetSystemInfo(&systemInfo);
+    std::uintptr_t pageSize = systemInfo.dwPageSize;
+
+    std::vector<PSAPI_WORKING_SET_EX_INFORMATION> pages;
+    for (std::uintptr_t page = begin & ~(pageSize - 1); page < end; page += pageSize) {
+        pages.emplace_back();
+        pages.back().VirtualAddress = reinterpret_cast<void *>(page);
+    }
+
+    if (!QueryWorkingSetEx(GetCurrentProcess(), pages.data(), static_cast<DWORD>(pages.size() * sizeof(PSAPI_WORKING_SET_EX_INFORMATION))))
+        return false;
+
+    for (const PSAPI_WORKING_SET_EX_INFORMATION &page : pages)
+        if (page.VirtualAttributes.Valid && page.VirtualAttributes.LargePage) {
+            std::uintptr_t address = reinterpret_cast<std::uintptr_t>(page.VirtualAddress);
+            numBytes += std::min(address + pageSize, end) - std::max(address, begin);
+        }
+
+    return true;
+#elif defined(__linux__)
+    // huge pages are counted per mapping, so adjacent arrays merged into one mapping share its count
+    std::ifstream file("/proc/self/smaps");
+    if (!file)
+        return false;
+
+    std::size_t overlap = 0;
+    std::size_t hugeBytes = 0;
+    std::string line;
+    while (std::getline(file, line)) {
+        unsigned long long mappingBegin, mappingEnd, kiloBytes;
+        char name[64];
+        if (std::sscanf(line.c_str(), "%llx-%llx ", &mappingBegin, &mappingEnd) == 2) {
+            numBytes += std::min(overlap, hugeBytes);
+            overlap = mappingBegin < end && mappingEnd > begin ?
+                std::min<std::uintptr_t>(mappingEnd, end) - std::max<std::uintptr_t>(mappingBegin, begin) : 0;
+            hugeBytes = 0;
+        } else if (overlap > 0 && std::sscanf(line.c_str(), "%63[^:]: %llu kB", name, &kiloBytes) == 2) {
+            std::string field(name);
+            if (field == "AnonHugePages" || field == "Private_Hugetlb" || field == "Shared_Hugetlb")
+                hugeBytes += kiloBytes * 1024;
+        }
+    }
+
+    numBytes += std::min(overlap, hugeBytes);
+    return true;
+#else
+    return false;
+#endif
+}
+
+long long Threading::getNumAllocations() {
+    return numAllocations;
+}
@@ -0,0 +1,93 @@
+#ifndef THREADING_H
+#define THREADING_H
+
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <utility>
+#include <vector>
+
+enum class ThreadAffinity {
+    NONE, // threads may run on all processors of the process
+    COMPACT, // consecutive threads on consecutive processors, filling one NUMA node before the next
+    SCATTER // consecutive threads on different NUMA nodes in turn
+};
+
+enum class WaitPolicy {
+    DEFAULT, // the default of the OpenMP runtime
+    SPIN, // threads waiting at barriers spin, for the lowest latency if every thread has a processor of its own
+    YIELD // threads waiting at barriers yield their processors, if processors are shared with other work
+};
+
+enum class HugePages {
+    NONE, // pages of the default size
+    TRANSPARENT, // the kernel may back large arrays with huge pages (Linux only)
+    EXPLICIT // large arrays are allocated from reserved huge pages (large pages on Windows), or else as with TRANSPARENT
+};
+
+class Threading {
+private:
+    static std::vector<std::vector<int>> findNodeProcessors();
+    static const std::vector<std::vector<int>> &getNodeProcessors(); // processors of the process on each NUMA node
+    static bool setThreadProcessors(const std::vector<int> &processors);
+
+public:
+    static int getNumNumaNodes();
+    static bool pinThread(ThreadAffinity affinity, int threadIndex); // pins the calling thread
+    static int getCurrentNumaNode(); // -1 if unknown
+    static bool countPagesOnNodes(const void *data, std::size_t size, std::vector<std::size_t> &pageCounts); // false if unknown
+
+    // the wait policy is read from the environment when the OpenMP runtime starts, so it applies to processes started later
+    static WaitPolicy getWaitPolicy(); // policy in the environment of this process
+    static bool setWaitPolicy(WaitPolicy policy); // sets the environment variables of the policy
+    static bool isWaitPolicySupported(); // false if the OpenMP runtime ignores the variables (vcomp of MSVC /openmp)
+    static bool restartProcess(char *argv[]); // replaces the process by a new one with the same arguments (only returns on failure)
+
+    // memory of arrays is aligned to cache lines, and arrays of at least one huge page are mapped in whole huge pages,
+    // which may be backed by huge pages as set by setHugePages() (which applies to arrays allocated later)
+    static void setHugePages(HugePages hugePages);
+    static HugePages getHugePages();
+    static std::size_t getHugePageSize();
+    static void *allocatePages(std::size_t size);
+    static void freePages(void *data, std::size_t size);
+    static bool countHugePageBytes(const void *data, std::size_t size, std::size_t &numBytes); // false if unknown
+    static long long getNumAllocations(); // allocations of pages (and calls of operator new in debug builds) by the calling thread
+};
+
+// allocator of particle and grid arrays, which default-initializes elements, so resizing does not write to the new pages
+// of an array and they are placed on the NUMA nodes of the threads which write them first (whole huge pages at once)
+template <typename T>
+class FirstTouchAllocator : public std::allocator<T> {
+public:
+    using value_type = T;
+
+    template <typename U>
+    struct rebind {
+        using other = FirstTouchAllocator<U>;
+    };
+
+    FirstTouchAllocator() = default;
+
+    template <typename U>
+    FirstTouchAllocator(const FirstTouchAllocator<U> &) {}
+
+    T *allocate(std::size_t count) {
+        return static_cast<T *>(Threading::allocatePages(count * sizeof(T)));
+    }
+
+    void deallocate(T *data, std::size_t count) {
+        Threading::freePages(data, count * sizeof(T));
+    }
+
+    template <typename U>
+    void construct(U *p) {
+        ::new (static_cast<void *>(p)) U;
+    }
+
+    template <typename U, typename... Args>
+    void construct(U *p, Args &&... args) {
+        ::new (static_cast<void *>(p)) U(std::forward<Args>(args)...);
+    }
+};
+
+#endif
@@ -0,0 +1,255 @@
+#include "Transport.h"
+
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+
+#if !defined(_WIN32)
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+#if !defined(_WIN32)
+static bool writeAll(int socket, const void *data, std::size_t size) {
+    const char *bytes = static_cast<const char *>(data);
+    while (size > 0) {
+        ssize_t written = ::send(socket, bytes, size, MSG_NOSIGNAL);
+        if (written <= 0)
+            return false;
+
+        bytes += written;
+        size -= written;
+    }
+
+    return true;
+}
+
+static bool readAll(int socket, void *data, std::size_t size) {
+    char *bytes = static_cast<char *>(data);
+    while (size > 0) {
+        ssize_t numRead = ::recv(socket, bytes, size, 0);
+        if (numRead <= 0)
+            return false;
+
+        bytes += numRead;
+        size -= numRead;
+    }
+
+    return true;
+}
+
+// resolves "unix:<path>" or "tcp:<host>:<port>" and calls function with the socket address (false if none works)
+template <typename Function>
+static bool forEachSocketAddress(const std::string &address, Function function) {
+    if (address.compare(0, 5, "unix:") == 0) {
+        sockaddr_un socketAddress = {};
+        socketAddress.sun_family = AF_UNIX;
+        std::string path = address.substr(5);
+        if (path.size() >= sizeof(socketAddress.sun_path))
+            return false;
+
+        path.copy(socketAddress.sun_path, path.size());
+        return function(AF_UNIX, reinterpret_cast<sockaddr *>(&socketAddress), static_cast<socklen_t>(sizeof(socketAddress)));
+    }
+
+    if (address.compare(0, 4, "tcp:") == 0) {
+        std::size_t colon = address.rfind(':');
+        if (colon <= 4)
+            return false;
+
+        std::string host = address.substr(4, colon - 4);
+        std::string port = address.substr(colon + 1);
+
+        addrinfo hints = {};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        addrinfo *addresses = nullptr;
+        if (getaddrinfo(host.c_str(), port.c_str(), &hints, &addresses) != 0)
+            return false;
+
+        bool succeeded = false;
+        for (addrinfo *info = addresses; info != nullptr && !succeeded; info = info->ai_next)
+            succeeded = function(info->ai_family, info->ai_addr, info->ai_addrlen);
+
+        freeaddrinfo(addresses);
+        return succeeded;
+    }
+
+    return false;
+}
+#endif
+
+SocketTransport::SocketTransport(int rank, const std::vector<std::string> &addresses)
+    : rank(rank), numRanks(static_cast<int>(addresses.size())), sockets(addresses.size(), -1) {
+    for (int i = 0; i < numRanks; ++i) {
+        sendMutexes.push_back(std::make_unique<std::mutex>());
+        queues.push_back(std::make_unique<MessageQueue>());
+    }
+
+#if !defined(_WIN32)
+    // each rank accepts connections of higher ranks and connects to lower ones, so every pair is connected once
+    int listener = -1;
+    bool failed = rank < numRanks - 1 && !listen(addresses[rank], listener);
+    if (failed)
+        std::cout << "ERROR: Failed to listen on " << addresses[rank] << std::endl;
+
+    for (int targetRank = 0; targetRank < rank && !failed; ++targetRank) {
+        std::int32_t sourceRank = rank;
+        if (!connect(addresses[targetRank], sockets[targetRank]) || !writeAll(sockets[targetRank], &sourceRank, sizeof(sourceRank))) {
+            std::cout << "ERROR: Failed to connect to rank " << targetRank << " at " << addresses[targetRank] << std::endl;
+            failed = true;
+        }
+    }
+
+    for (int i = rank + 1; i < numRanks && !failed; ++i) {
+        int socket = accept(listener, nullptr, nullptr);
+        std::int32_t sourceRank = -1;
+        if (socket < 0 || !readAll(socket, &sourceRank, sizeof(sourceRank)) || sourceRank <= rank || sourceRank >= numRanks) {
+            std::cout << "ERROR: Failed to accept a connection on " << addresses[rank] << std::endl;
+            if (socket >= 0)
+                close(socket);
+            break;
+        }
+
+        int noDelay = 1; // fails harmlessly for unix sockets
+        setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+        sockets[sourceRank] = socket;
+    }
+
+    if (listener >= 0) {
+        close(listener);
+        if (addresses[rank].compare(0, 5, "unix:") == 0)
+            unlink(addresses[rank].substr(5).c_str());
+    }
+
+    for (int sourceRank = 0; sourceRank < numRanks; ++sourceRank)
+        if (sockets[sourceRank] >= 0)
+            readers.emplace_back(&SocketTransport::read, this, sourceRank);
+        else
+            queues[sourceRank]->close(); // receiving from ranks without a connection fails at once
+#else
+    std::cout << "ERROR: Socket transport is not supported on Windows." << std::endl;
+    for (std::unique_ptr<MessageQueue> &queue : queues)
+        queue->close();
+#endif
+}
+
+SocketTransport::~SocketTransport() {
+#if !defined(_WIN32)
+    // readers stop at the end of their connections
+    for (int socket : sockets)
+        if (socket >= 0)
+            shutdown(socket, SHUT_RDWR);
+
+    for (std::thread &reader : readers)
+        reader.join();
+
+    for (int socket : sockets)
+        if (socket >= 0)
+            close(socket);
+#endif
+}
+
+bool SocketTransport::listen(const std::string &address, int &listener) {
+#if !defined(_WIN32)
+    if (address.compare(0, 5, "unix:") == 0)
+        unlink(address.substr(5).c_str());
+
+    return forEachSocketAddress(address, [&](int family, const sockaddr *socketAddress, socklen_t length) {
+        listener = socket(family, SOCK_STREAM, 0);
+        if (listener < 0)
+            return false;
+
+        int reuse = 1;
+        setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+        if (bind(listener, socketAddress, length) == 0 && ::listen(listener, numRanks) == 0)
+            return true;
+
+        close(listener);
+        listener = -1;
+        return false;
+    });
+#else
+    return false;
+#endif
+}
+
+bool SocketTransport::connect(const std::string &address, int &connection) {
+#if !defined(_WIN32)
+    // the other rank may not listen yet, so connecting is retried for a minute
+    for (int attempt = 0; attempt < 600; ++attempt) {
+        bool connected = forEachSocketAddress(address, [&](int family, const sockaddr *socketAddress, socklen_t length) {
+            connection = socket(family, SOCK_STREAM, 0);
+            if (connection < 0)
+                return false;
+
+            if (::connect(connection, socketAddress, length) == 0) {
+                // halo messages are small and latency bound
+                int noDelay = 1;
+                if (family != AF_UNIX)
+                    setsockopt(connection, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+                return true;
+            }
+
+            close(connection);
+            connection = -1;
+            return false;
+        });
+
+        if (connected)
+            return true;
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+#endif
+
+    return false;
+}
+
+void SocketTransport::read(int sourceRank) {
+#if !defined(_WIN32)
+    // messages are framed by their sizes
+    while (true) {
+        std::uint64_t size = 0;
+        Message message;
+        if (!readAll(sockets[sourceRank], &size, sizeof(size)))
+            break;
+
+        message.resize(size);
+        if (!readAll(sockets[sourceRank], message.data(), size))
+            break;
+
+        queues[sourceRank]->push(std::move(message));
+    }
+#endif
+
+    queues[sourceRank]->close();
+}
+
+bool SocketTransport::isConnected() const {
+    for (int i = 0; i < numRanks; ++i)
+        if (i != rank && sockets[i] < 0)
+            return false;
+
+    return true;
+}
+
+void SocketTransport::send(int targetRank, Message message) {
+#if !defined(_WIN32)
+    // the reader thread of the receiver drains its socket, so sending does not wait for the receiver to call receive()
+    std::lock_guard<std::mutex> lock(*sendMutexes[targetRank]);
+    std::uint64_t size = message.size();
+    if (sockets[targetRank] < 0 || !writeAll(sockets[targetRank], &size, sizeof(size)) ||
+        !writeAll(sockets[targetRank], message.data(), message.size()))
+        std::cout << "ERROR: Failed to send a message to rank " << targetRank << std::endl;
+#endif
+}
+
+bool SocketTransport::receive(int sourceRank, Message &message) {
+    return queues[sourceRank]->pop(message);
+}
@@ -0,0 +1,160 @@
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+using Message = std::vector<char>;
+
+// appends the bytes of values to a message
+template <typename T>
+void writeMessage(Message &message, const T *values, std::size_t count) {
+    std::size_t offset = message.size();
+    message.resize(offset + count * sizeof(T));
+    if (count > 0)
+        std::memcpy(message.data() + offset, values, count * sizeof(T));
+}
+
+// reads values from a message at offset (false if the message is too short)
+template <typename T>
+bool readMessage(const Message &message, std::size_t &offset, T *values, std::size_t count) {
+    if (offset + count * sizeof(T) > message.size())
+        return false;
+
+    if (count > 0)
+        std::memcpy(values, message.data() + offset, count * sizeof(T));
+    offset += count * sizeof(T);
+    return true;
+}
+
+// messages from one rank to another, in the order they were sent
+class MessageQueue {
+private:
+    std::mutex mutex;
+    std::condition_variable received;
+    std::deque<Message> messages;
+    bool closed = false;
+
+public:
+    void push(Message message) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            messages.push_back(std::move(message));
+        }
+        received.notify_one();
+    }
+
+    // waits for the next message (false if the queue was closed before one arrived)
+    bool pop(Message &message) {
+        std::unique_lock<std::mutex> lock(mutex);
+        received.wait(lock, [this] { return closed || !messages.empty(); });
+        if (messages.empty())
+            return false;
+
+        message = std::move(messages.front());
+        messages.pop_front();
+        return true;
+    }
+
+    void close() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            closed = true;
+        }
+        received.notify_all();
+    }
+};
+
+// point-to-point messages between the ranks of a domain-decomposed simulation,
+// the same interface for ranks in one process, in processes on one machine or on several machines
+class Transport {
+public:
+    virtual ~Transport() = default;
+    virtual int getRank() const = 0;
+    virtual int getNumRanks() const = 0;
+    virtual void send(int rank, Message message) = 0; // never waits for the receiver, so all ranks may send before receiving
+    virtual bool receive(int rank, Message &message) = 0; // waits for the next message from rank (false if the connection is lost)
+};
+
+// queues of messages between ranks which are threads of one process
+class InProcessNetwork {
+private:
+    int numRanks;
+    std::vector<std::unique_ptr<MessageQueue>> queues; // queue from rank i to rank j at i * numRanks + j
+
+public:
+    explicit InProcessNetwork(int numRanks) : numRanks(numRanks) {
+        for (int i = 0; i < numRanks * numRanks; ++i)
+            queues.push_back(std::make_unique<MessageQueue>());
+    }
+
+    int getNumRanks() const { return numRanks; }
+
+    MessageQueue &getQueue(int sourceRank, int targetRank) {
+        return *queues[sourceRank * numRanks + targetRank];
+    }
+};
+
+// ranks in one process exchange messages through shared memory
+class InProcessTransport : public Transport {
+private:
+    InProcessNetwork &network;
+    int rank;
+
+public:
+    InProcessTransport(InProcessNetwork &network, int rank) : network(network), rank(rank) {}
+
+    // like a closed socket, a rank which stops makes the receives of the other ranks fail
+    ~InProcessTransport() override {
+        for (int targetRank = 0; targetRank < network.getNumRanks(); ++targetRank)
+            network.getQueue(rank, targetRank).close();
+    }
+
+    int getRank() const override { return rank; }
+    int getNumRanks() const override { return network.getNumRanks(); }
+
+    void send(int targetRank, Message message) override {
+        network.getQueue(rank, targetRank).push(std::move(message));
+    }
+
+    bool receive(int sourceRank, Message &message) override {
+        return network.getQueue(sourceRank, rank).pop(message);
+    }
+};
+
+// ranks are processes connected by stream sockets, with addresses "unix:<path>" on one machine
+// or "tcp:<host>:<port>" across machines (not available on Windows)
+class SocketTransport : public Transport {
+private:
+    int rank;
+    int numRanks;
+    std::vector<int> sockets; // connection to each rank (-1 for this rank)
+    std::vector<std::unique_ptr<std::mutex>> sendMutexes;
+    std::vector<std::unique_ptr<MessageQueue>> queues; // messages received from each rank
+    std::vector<std::thread> readers; // one thread per connection reads its messages into the queue
+
+    bool listen(const std::string &address, int &listener);
+    bool connect(const std::string &address, int &socket);
+    void read(int sourceRank);
+
+public:
+    // connects to all ranks, listening on addresses[rank] (false from isConnected() on failure)
+    SocketTransport(int rank, const std::vector<std::string> &addresses);
+    ~SocketTransport() override;
+
+    bool isConnected() const;
+
+    int getRank() const override { return rank; }
+    int getNumRanks() const override { return numRanks; }
+    void send(int targetRank, Message message) override;
+    bool receive(int sourceRank, Message &message) override;
+};
+
+#endif
@@ -6,7 +6,9 @@
 #include <glm/glm.hpp>
 
 #include <iostream>
+#include <memory>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include "shader.h"
@@ -21,6 +23,9 @@
 #include "Object.h"
 
 #include "Simulator.h"
+#include "SimulationWorker.h"
+#include "Ensemble.h"
+#include "DomainDecomposition.h"
 
 enum class DisplayMode {
     DEFAULT,
@@ -36,6 +41,10 @@ void processMouseMove(GLFWwindow *window, double deltaX, double deltaY);
 void processMouseScroll(GLFWwindow *window, double deltaX, double deltaY);
 unsigned int loadCubemap(const std::string &path, const std::string &type, bool gammaCorrection);
 unsigned int loadTexture(const std::string &path, bool gammaCorrection);
+int runEnsemble(int numFrames);
+double runSubdomain(Transport &transport, int numFrames, int numThreads);
+int runWeakScaling(int maxNumRanks, int numFrames);
+int runStartupBenchmark(int maxMillions);
 
 // timer
 float startTime = 0.0f;
@@ -49,11 +58,15 @@ const unsigned int screenWidth = 1280;
 const unsigned int screenHeight = 720;
 DisplayMode displayMode = DisplayMode::DEFAULT;
 bool printFPS = false;
+bool printSimulationInfo = false;
 bool fixFPS = false;
 
 // key
 bool pauseKeyPressed = false;
 bool resetKeyPressed = false;
+bool switchSolverKeyPressed = false;
+bool switchThreadAffinityKeyPressed = false;
+bool printNumaReportKeyPressed = false;
 bool fixCameraKeyPressed = false;
 bool displayDefaultKeyPressed = false;
 bool displayDepth0KeyPressed = false;
@@ -112,8 +125,65 @@ glm::vec3 fluidPositionMin = containerCornerPosition + particleDiameter;
 glm::vec3 fluidPositionMax = containerCornerPosition + particleDiameter + glm::vec3(containerSize) * particleDiameter;
 
 Simulator simulator(sceneType, timeStep, particleRadius, fluidSize, fluidCornerPosition, containerSize, containerCornerPosition);
+int lookAheadDepth = 3; // max number of frames simulated ahead of the displayed one
+SimulationWorker simulationWorker(simulator, lookAheadDepth); // the simulator is only accessed by the worker once it is started
+
+int main(int argc, char *argv[]) {
+    // threading and memory options precede the others: PositionBasedFluids [--threads <count|auto>] [--affinity <none|compact|scatter>]
+    // [--wait-policy <default|spin|yield>] [--huge-pages <none|transparent|explicit>] ...,
+    // where the number of threads and the affinity are those of the interactive simulator
+    int numOptions = 0;
+    while (numOptions + 2 < argc) {
+        std::string option = argv[1 + numOptions];
+        std::string value = argv[2 + numOptions];
+        if (option == "--threads") {
+            simulator.autoNumThreads = value == "auto";
+            simulator.numThreads = simulator.autoNumThreads ? 0 : std::stoi(value);
+        } else if (option == "--affinity")
+            simulator.threadAffinity = value == "compact" ? ThreadAffinity::COMPACT : value == "scatter" ? ThreadAffinity::SCATTER : ThreadAffinity::NONE;
+        else if (option == "--huge-pages") {
+            Threading::setHugePages(value == "none" ? HugePages::NONE : value == "explicit" ? HugePages::EXPLICIT : HugePages::TRANSPARENT);
+            simulator.reset(); // arrays of the interactive simulator are allocated again
+        } else if (option == "--wait-policy") {
+            WaitPolicy waitPolicy = value == "spin" ? WaitPolicy::SPIN : value == "yield" ? WaitPolicy::YIELD : WaitPolicy::DEFAULT;
+
+            // the OpenMP runtime of this process has started, so a process with the policy in its environment takes over
+            if (!Threading::isWaitPolicySupported())
+                std::cout << "ERROR: The OpenMP runtime ignores the wait policy (build with /openmp:llvm to use it)." << std::endl;
+            else if (waitPolicy != Threading::getWaitPolicy() && (!Threading::setWaitPolicy(waitPolicy) || !Threading::restartProcess(argv)))
+                std::cout << "ERROR: Failed to restart with the wait policy " << value << "." << std::endl;
+        } else
+            break;
+
+        numOptions += 2;
+    }
+
+    argv[numOptions] = argv[0];
+    argv += numOptions;
+    argc -= numOptions;
+
+    // run a parameter study without a window: PositionBasedFluids --ensemble [frames]
+    if (argc > 1 && std::string(argv[1]) == "--ensemble")
+        return runEnsemble(argc > 2 ? std::stoi(argv[2]) : 100);
+
+    // benchmark scene creation of 1M, 10M and 50M particles: PositionBasedFluids --startup-benchmark [max millions of particles]
+    if (argc > 1 && std::string(argv[1]) == "--startup-benchmark")
+        return runStartupBenchmark(argc > 2 ? std::stoi(argv[2]) : 50);
+
+    // benchmark domain decomposition with ranks in one process: PositionBasedFluids --weak-scaling [max ranks] [frames]
+    if (argc > 1 && std::string(argv[1]) == "--weak-scaling")
+        return runWeakScaling(argc > 2 ? std::stoi(argv[2]) : 4, argc > 3 ? std::stoi(argv[3]) : 50);
+
+    // run one rank of the benchmark as a process: PositionBasedFluids --subdomain <rank> <frames> <address of rank 0> <address of rank 1> ...
+    // with addresses unix:<path> or tcp:<host>:<port>
+    if (argc > 4 && std::string(argv[1]) == "--subdomain") {
+        SocketTransport transport(std::stoi(argv[2]), std::vector<std::string>(argv + 4, argv + argc));
+        if (!transport.isConnected())
+            return -1;
+
+        return runSubdomain(transport, std::stoi(argv[3]), 0) >= 0.0 ? 0 : -1;
+    }
 
-int main() {
     // set GLFW
     glfwInit();
     glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
@@ -327,6 +397,9 @@ int main() {
     float cameraDefaultTheta = atanf(cameraDefaultPosition.x / cameraDefaultPosition.z);
     float cameraDefaultYaw = camera.yaw;
 
+    // run the simulation concurrently with rendering
+    simulationWorker.start();
+
     // render loop
     while (!glfwWindowShouldClose(window)) {
         // process the input
@@ -365,15 +438,48 @@ int main() {
             }
         }
 
+        // take the next simulated frame (the last one is drawn again if the simulation is behind)
+        bool newFrame = simulationWorker.acquireFrame();
+        const SimulationFrame &frame = simulationWorker.getFrame();
+
+        // show simulation info
+        if (printSimulationInfo && newFrame && !frame.isPaused) {
+            std::cout << "substeps = " << frame.numSubsteps
+                << ", active particles = " << frame.numActiveParticles
+                << ", iterations = " << frame.numIterationUsed
+                << ", neighbour searches = " << frame.numNeighbourSearchesUsed
+                << ", average density error = " << frame.averageDensityError
+                << ", max density error = " << frame.maxDensityError
+                << ", solver time = " << frame.solverTime
+                << ", phase times (prediction, neighbour search, solve, velocity correction, bookkeeping) = "
+                << frame.phaseTimes.prediction << ", " << frame.phaseTimes.neighbourSearch << ", " << frame.phaseTimes.solve
+                << ", " << frame.phaseTimes.velocityCorrection << ", " << frame.phaseTimes.bookkeeping
+                << ", wall-clock per simulated second = " << frame.wallClockTime / glm::max(frame.simulatedTime, 1.0e-6)
+                << ", particle updates per simulated second = " << frame.numParticleUpdates / glm::max(frame.simulatedTime, 1.0e-6) << std::endl;
+
+            std::cout << "threads = " << frame.threadTimes.size() << ", thread busy / idle =";
+            for (const ThreadTime &threadTime : frame.threadTimes)
+                std::cout << " " << threadTime.busy << " / " << threadTime.idle;
+            std::cout << std::endl;
+
+            FrameQueueStats queueStats = simulationWorker.getQueueStats();
+            std::cout << "frame queue depth = " << queueStats.depth << " / " << queueStats.lookAheadDepth
+                << ", simulation stalls = " << queueStats.numProducerStalls << " (" << queueStats.producerStallTime << " s)"
+                << ", display stalls = " << queueStats.numConsumerStalls
+                << ", dropped frames = " << queueStats.numDroppedFrames << std::endl;
+        }
+
         // bind g-buffer
         glBindFramebuffer(GL_FRAMEBUFFER, gBuffer);
         glStencilMask(0xFF);
         glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT | GL_STENCIL_BUFFER_BIT);
 
         // copy buffer data (positions of particles)
-        glBindVertexArray(particle.mesh.VAO);
-        glBufferData(GL_ARRAY_BUFFER, simulator.numFluidParticles * sizeof(glm::vec3), &simulator.positions[0], GL_STATIC_DRAW);
-        glBindVertexArray(0);
+        if (newFrame) {
+            glBindVertexArray(particle.mesh.VAO);
+            glBufferData(GL_ARRAY_BUFFER, frame.numFluidParticles * sizeof(glm::vec3), &frame.positions[0], GL_STATIC_DRAW);
+            glBindVertexArray(0);
+        }
 
         // calculate depth
         shaderDepth.use();
@@ -385,7 +491,7 @@ int main() {
         glStencilMask(0xFF);
 
         glBindVertexArray(particle.mesh.VAO);
-        glDrawElementsInstanced(GL_TRIANGLES, particle.mesh.indices.size(), GL_UNSIGNED_INT, 0, simulator.numFluidParticles);
+        glDrawElementsInstanced(GL_TRIANGLES, particle.mesh.indices.size(), GL_UNSIGNED_INT, 0, frame.numFluidParticles);
 
         glStencilFunc(GL_EQUAL, 1, 0xFF);
         glStencilMask(0x00);
@@ -419,7 +525,7 @@ int main() {
         glBlendFunc(GL_ONE, GL_ONE);
 
         glBindVertexArray(particle.mesh.VAO);
-        glDrawElementsInstanced(GL_TRIANGLES, particle.mesh.indices.size(), GL_UNSIGNED_INT, 0, simulator.numFluidParticles);
+        glDrawElementsInstanced(GL_TRIANGLES, particle.mesh.indices.size(), GL_UNSIGNED_INT, 0, frame.numFluidParticles);
 
         glDisable(GL_BLEND);
         glBindVertexArray(0);
@@ -509,10 +615,10 @@ int main() {
 
         glfwSwapBuffers(window); // swap the buffers
         glfwPollEvents(); // poll events
-
-        simulator.simulate();
     }
 
+    simulationWorker.stop();
+
     // clear
     cube.clear();
     plane.clear();
@@ -552,7 +658,7 @@ void processKeyboardInput(GLFWwindow *window) {
     if (glfwGetKey(window, GLFW_KEY_ENTER) == GLFW_PRESS) {
         if (!pauseKeyPressed) {
             pauseKeyPressed = true;
-            simulator.pause();
+            simulationWorker.request([](Simulator &simulator) { simulator.pause(); });
             startTime = glfwGetTime();
         }
     } else
@@ -561,11 +667,58 @@ void processKeyboardInput(GLFWwindow *window) {
     if (glfwGetKey(window, GLFW_KEY_R) == GLFW_PRESS) {
         if (!resetKeyPressed) {
             resetKeyPressed = true;
-            simulator.reset();
+            simulationWorker.request([](Simulator &simulator) {
+                simulator.reset();
+                std::cout << "reset = " << simulator.resetTime << " s" << std::endl;
+            });
         }
     } else
         resetKeyPressed = false;
 
+    if (glfwGetKey(window, GLFW_KEY_M) == GLFW_PRESS) {
+        if (!switchSolverKeyPressed) {
+            switchSolverKeyPressed = true;
+            simulationWorker.request([](Simulator &simulator) { simulator.switchSolverType(); });
+        }
+    } else
+        switchSolverKeyPressed = false;
+
+    if (glfwGetKey(window, GLFW_KEY_T) == GLFW_PRESS) {
+        if (!switchThreadAffinityKeyPressed) {
+            switchThreadAffinityKeyPressed = true;
+            simulationWorker.request([](Simulator &simulator) { simulator.switchThreadAffinity(); });
+        }
+    } else
+        switchThreadAffinityKeyPressed = false;
+
+    if (glfwGetKey(window, GLFW_KEY_N) == GLFW_PRESS) {
+        if (!printNumaReportKeyPressed) {
+            printNumaReportKeyPressed = true;
+
+            // the report is made by the threads of the worker
+            simulationWorker.request([](Simulator &simulator) {
+                NumaReport report = simulator.getNumaReport();
+                if (report.available) {
+                    std::cout << "NUMA nodes = " << report.numNodes << ", pages of particle arrays on nodes =";
+                    for (std::size_t pages : report.pagesOnNodes)
+                        std::cout << " " << pages;
+                    std::cout << ", pages local to their threads = " << report.numLocalPages << " / " << report.numPages << std::endl;
+                } else
+                    std::cout << "NUMA placement is not available" << std::endl;
+
+                HugePageReport hugePageReport = simulator.getHugePageReport();
+                if (hugePageReport.available) {
+                    std::cout << "bytes on huge pages of " << hugePageReport.hugePageSize << " bytes";
+                    for (const ArrayPages &array : hugePageReport.arrays)
+                        std::cout << ", " << array.name << " = " << array.numHugePageBytes << " / " << array.numBytes;
+                    std::cout << std::endl;
+                } else
+                    std::cout << "huge pages are not available" << std::endl;
+            });
+        }
+    } else
+        printNumaReportKeyPressed = false;
+
     if (glfwGetKey(window, GLFW_KEY_F) == GLFW_PRESS) {
         if (!fixCameraKeyPressed) {
             fixCameraKeyPressed = true;
@@ -715,4 +868,144 @@ unsigned int loadTexture(const std::string &path, bool gammaCorrection) {
 
     stbi_set_flip_vertically_on_load(false);
     return texture;
+}
+
+int runEnsemble(int numFrames) {
+    Ensemble ensemble;
+    ensemble.numFrames = numFrames;
+
+    // small dam breaks, which do not scale across many threads on their own
+    glm::ivec3 runFluidSize(10, 20, 10);
+    glm::ivec3 runContainerSize(3 * runFluidSize.x, 3 * runFluidSize.y, runFluidSize.z);
+    glm::vec3 runContainerCornerPosition = glm::vec3(-0.5f, 0.0f, -0.5f) * glm::vec3(runContainerSize) * particleDiameter;
+
+    // results are deterministic, so state hashes of runs can be compared with golden frames
+    auto createSimulator = [&]() {
+        std::unique_ptr<Simulator> runSimulator = std::make_unique<Simulator>(SceneType::DEFAULT, timeStep, particleRadius, runFluidSize,
+            glm::vec3(0.0f), runContainerSize, runContainerCornerPosition);
+        runSimulator->deterministic = true;
+        return runSimulator;
+    };
+
+    // iterations and relaxation of PBF
+    for (int numIteration = 2; numIteration <= 8; numIteration *= 2)
+        for (float epsilonCFM : { 300.0f, 600.0f, 1200.0f }) {
+            Simulator &runSimulator = ensemble.add("pbf_iterations_" + std::to_string(numIteration) + "_cfm_" + std::to_string(static_cast<int>(epsilonCFM)),
+                createSimulator());
+            runSimulator.numIteration = numIteration;
+            runSimulator.epsilonCFM = epsilonCFM;
+        }
+
+    // the other solvers with default parameters
+    ensemble.add("xpbd", createSimulator()).solverType = SolverType::XPBD;
+    ensemble.add("dfsph", createSimulator()).solverType = SolverType::DFSPH;
+    ensemble.add("iisph", createSimulator()).solverType = SolverType::IISPH;
+
+    double startTime = omp_get_wtime();
+    ensemble.run();
+
+    std::cout << ensemble.runs.size() << " runs of " << numFrames << " frames in " << omp_get_wtime() - startTime << " s" << std::endl;
+    for (const EnsembleRun &run : ensemble.runs)
+        std::cout << run.name << ": " << run.wallClockTime << " s" << std::endl;
+
+    return 0;
+}
+
+double runSubdomain(Transport &transport, int numFrames, int numThreads) {
+    int numRanks = transport.getNumRanks();
+
+    // every rank owns a block of the same size of a tank, whose length grows with the number of ranks (weak scaling)
+    glm::ivec3 rankFluidSize(20, 20, 20);
+    glm::ivec3 tankFluidSize(numRanks * rankFluidSize.x, rankFluidSize.y, rankFluidSize.z);
+    glm::ivec3 tankSize(tankFluidSize.x, 2 * tankFluidSize.y, tankFluidSize.z);
+    glm::vec3 tankCornerPosition = glm::vec3(-0.5f, 0.0f, -0.5f) * glm::vec3(tankSize) * particleDiameter;
+
+    // the fluid is only created once the simulator is restricted to the subdomain
+    Simulator subdomainSimulator(SceneType::DEFAULT, timeStep, particleRadius, glm::ivec3(0), glm::vec3(0.0f), tankSize, tankCornerPosition);
+    subdomainSimulator.fluidSize = tankFluidSize;
+    subdomainSimulator.numThreads = numThreads;
+
+    Subdomain subdomain(transport, glm::ivec3(numRanks, 1, 1));
+    subdomain.attach(subdomainSimulator);
+    subdomainSimulator.isPaused = false;
+
+    double startTime = omp_get_wtime();
+    for (int frame = 0; frame < numFrames; ++frame) {
+        subdomainSimulator.simulate();
+
+        // the simulation of the subdomain stops when a neighbour is lost
+        if (!subdomain.isConnected()) {
+            std::cout << "ERROR: Stopped rank " << transport.getRank() << " after " << frame << " frames" << std::endl;
+            return -1.0;
+        }
+    }
+
+    // the slowest rank sets the pace
+    double time = subdomain.maxOverRanks(omp_get_wtime() - startTime);
+    double numParticles = subdomain.sumOverRanks(subdomainSimulator.getNumOwnedParticles());
+    double numGhostParticles = subdomain.sumOverRanks(subdomainSimulator.numGhostParticles);
+    double maxDensityError = subdomain.maxOverRanks(subdomainSimulator.maxDensityError);
+
+    if (transport.getRank() == 0)
+        std::cout << numRanks << " ranks, " << numParticles << " particles, " << numGhostParticles << " ghost particles: "
+            << 1000.0 * time / numFrames << " ms per frame, max density error " << maxDensityError << std::endl;
+
+    return time;
+}
+
+int runWeakScaling(int maxNumRanks, int numFrames) {
+    double baseTime = 0.0;
+
+    for (int numRanks = 1; numRanks <= maxNumRanks; numRanks *= 2) {
+        // ranks are threads of this process and share the threads of OpenMP
+        InProcessNetwork network(numRanks);
+        std::vector<double> times(numRanks);
+        std::vector<std::thread> ranks;
+        for (int rank = 0; rank < numRanks; ++rank)
+            ranks.emplace_back([&, rank]() {
+                InProcessTransport transport(network, rank);
+                times[rank] = runSubdomain(transport, numFrames, glm::max(omp_get_max_threads() / numRanks, 1));
+            });
+
+        for (std::thread &rank : ranks)
+            rank.join();
+
+        if (numRanks == 1)
+            baseTime = times[0];
+
+        std::cout << "weak scaling efficiency with " << numRanks << " ranks: " << baseTime / times[0] << std::endl;
+    }
+
+    return 0;
+}
+
+int runStartupBenchmark(int maxMillions) {
+    for (int millions : { 1, 10, 50 }) {
+        if (millions > maxMillions)
+            break;
+
+        // a cube of fluid in a container twice as long and high
+        int size = static_cast<int>(glm::round(glm::pow(millions * 1.0e6f, 1.0f / 3.0f)));
+        glm::ivec3 benchmarkFluidSize(size);
+        glm::ivec3 benchmarkContainerSize(2 * size, 2 * size, size);
+        glm::vec3 benchmarkContainerCornerPosition = glm::vec3(-0.5f, 0.0f, -0.5f) * glm::vec3(benchmarkContainerSize) * particleDiameter;
+
+        double startTime = omp_get_wtime();
+        Simulator benchmarkSimulator(SceneType::DEFAULT, timeStep, particleRadius, benchmarkFluidSize, glm::vec3(0.0f),
+            benchmarkContainerSize, benchmarkContainerCornerPosition);
+        double constructionTime = omp_get_wtime() - startTime;
+        float firstResetTime = benchmarkSimulator.resetTime;
+
+        // a reset with another fluid block reuses the boundary
+        benchmarkSimulator.fluidSize.y = size / 2;
+        benchmarkSimulator.reset();
+        benchmarkSimulator.fluidSize.y = size;
+        benchmarkSimulator.reset();
+
+        std::cout << benchmarkSimulator.numFluidParticles << " fluid and " << benchmarkSimulator.numBoundaryParticles << " boundary particles: "
+            << "construction " << constructionTime << " s (reset " << firstResetTime << " s), reset of the fluid "
+            << benchmarkSimulator.resetTime << " s" << std::endl;
+    }
+
+    return 0;
 }
\ No newline at end of file